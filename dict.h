@@ -67,6 +67,7 @@ typedef unsigned char*       ucharptr;
 typedef unsigned short*      ushortptr;
 typedef unsigned long*       ulongptr;
 typedef unsigned long long*  ullongptr;
+typedef char*                charptr;
 
 
 #define TYPELIST(X) \
@@ -100,6 +101,7 @@ typedef unsigned long long*  ullongptr;
 	X(T_USHORTPTR,   ushortptr,   mushortptr,   "%p",    )              \
 	X(T_ULONGPTR,    ulongptr,    mulongptr,    "%p",    )              \
 	X(T_ULLONGPTR,   ullongptr,   mullongptr,   "%p",    )              \
+	X(T_CHARPTR,     charptr,     mcharptr,     "%s",    )              \
 	EXTRA_DICT_TYPES(X)
 
 /*
@@ -125,6 +127,12 @@ bool CONCAT(dict_get_,ctype)(int handle, const char * key, ctype * val) ;
 TYPELIST(X)
 #undef X
 
+// sets n keys at once; the storage grows once up front, but each key is still looked up as in dict_set
+#define X(typesymbol,ctype,varname,_a,_b)  \
+void CONCAT(dict_set_batch_,ctype)(int handle, size_t n, const char * const * keys, const ctype * vals) ;
+TYPELIST(X)
+#undef X
+
 #define X(typesymbol,ctype,varname,_a,_b)  \
 bool CONCAT(dict_getref_,ctype)(int handle, const char * key, ctype ** val) ;
 TYPELIST(X)
@@ -353,6 +361,23 @@ dict_lookup(int handle, const char * key)
 	return 0;
 }
 
+/*
+	Make room for at least n entries, growing geometrically like dict_grow_if_needed.
+*/
+static void 
+dict_reserve(int handle, size_t n)
+{
+	if (dicts[handle].capacity < n) {
+		size_t newcap = MAX(512, MAX(n, 2*dicts[handle].capacity));
+		dicts[handle].entries = realloc(dicts[handle].entries, newcap * sizeof dicts[handle].entries[0]);
+		if (!dicts[handle].entries) {
+			perror ("dict_reserve");
+			exit   (EXIT_FAILURE);
+		}
+		dicts[handle].capacity = newcap;
+	}
+}
+
 /*
 	See if we still have enough free space allocated to add one element to the dict.
 	If not, reallocate to make more space.
@@ -391,6 +416,17 @@ void CONCAT(dict_set_,ctype)(int handle, const char * key, ctype x) \
 TYPELIST(X)
 #undef X
 
+#define X(typesymbol,ctype,varname,_a,_b)  \
+void CONCAT(dict_set_batch_,ctype)(int handle, size_t n, const char * const * keys, const ctype * vals) \
+{                                                      \
+	if (!handle_check(handle)) return;             \
+	dict_reserve(handle, dicts[handle].n_entries + n); \
+	for (size_t i = 0; i < n; i++)                 \
+		CONCAT(dict_set_,ctype)(handle, keys[i], vals[i]); \
+}
+TYPELIST(X)
+#undef X
+
 
 typedef void (*dict_key_error_callback)(const char * notfound_key, int dict_handle, const char * type_name);
 
@@ -513,6 +549,7 @@ void dict_dump (int handle, FILE * where)
 
 #ifdef DICT_SELF_TEST
 
+#include <assert.h>
 
 int main (void) 
 {
@@ -547,6 +584,28 @@ int main (void)
 	dict_dump(d,stdout);
 	rmdict(d);
 
+	printf("\n");
+	d = mkdict();
+	static char keybuf[4096][16];
+	const char * keys[64];
+	int vals[64];
+	size_t reallocs = 0, cap = 0;
+	for (int b = 0; b < 64; b++) {
+		for (int i = 0; i < 64; i++) {
+			snprintf(keybuf[b*64 + i], sizeof keybuf[0], "key %i", b*64 + i);
+			keys[i] = keybuf[b*64 + i];
+			vals[i] = b*64 + i;
+		}
+		dict_set_batch_int(d, 64, keys, vals);
+		if (dicts[d].capacity != cap) reallocs++;
+		cap = dicts[d].capacity;
+	}
+	x = 0;
+	dict_get(d, "key 4095", &x);
+	printf("64 batches of 64: %zu entries, %zu reallocations, key 4095: %i\n", dicts[d].n_entries, reallocs, x);
+	assert(dicts[d].n_entries == 4096 && reallocs <= 4 && x == 4095);
+	rmdict(d);
+
 }
 
 
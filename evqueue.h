@@ -1,265 +1,2496 @@
 #ifndef EVQUEUE_H
 #define EVQUEUE_H
 
+/*
+	A bounded, thread-safe queue of typed events.
+
+	Every event is an opaque blob of itemsize bytes tagged with an int type.
+	Producers put events with evqueue_putevents, consumers take them with
+	evqueue_getevents, optionally restricted to a set of types (filters).
+
+	Queued events are indexed by type: each type has its own FIFO, so a
+	filtered get only touches events that match. Every blocked thread waits
+	on its own condition variable, and each put or get signals only as many
+	waiters as it can satisfy: a consumer is only woken when an event of a
+	type it asked for arrives, a producer only when a slot frees up for it.
+
+	Events carry a priority in [0, EVQUEUE_NPRIO), higher is more urgent. Consumers
+	always get the highest-priority matching event, oldest first within a priority;
+	events put without a priority get 0. Each type keeps a FIFO only for the levels
+	it has events at, most urgent first, so get stays O(1) per event (O(nfilters)
+	for a filtered get) and put walks at most the levels the type is using.
+
+	evqueue_broadcast makes a different kind of queue, where every subscriber gets
+	every event instead of each event going to one consumer (see below).
+
+	timeout_ms < 0 waits forever, timeout_ms == 0 never waits for events or free
+	slots (though it does wait for the queue's lock), and timeout_ms > 0 waits at
+	most that many milliseconds.
+
+	To use: define EVQUEUE_IMPLEMENTATION in one .c file, before you include this header.
+*/
+
 #ifndef EVQUEUE_API
 #define EVQUEUE_API
 #endif
-EVQUEUE_API void* 
+
+#ifndef EVQUEUE_NPRIO
+#define EVQUEUE_NPRIO 8
+#endif
+
+/*
+	State that different threads write (the lock and what it guards, the generation
+	counters spinners watch, ...) is kept on separate cache lines of this size.
+	Define as 0 to pack everything together instead.
+*/
+#ifndef EVQUEUE_CACHELINE
+#define EVQUEUE_CACHELINE 64
+#endif
+
+/*
+	Returns NULL if maxitems is 0 or more than 2^30, or if allocation fails.
+*/
+EVQUEUE_API void*
 evqueue (unsigned maxitems, unsigned itemsize) ;
 
+/*
+	As evqueue, with every event slot aligned to align bytes (a power of two), e.g.
+	alignof(your event type), or EVQUEUE_CACHELINE so that consumers processing
+	neighbouring events in place never share a cache line. Slots are then
+	itemsize rounded up to align bytes apart; arrays passed to putevents and
+	getevents are still packed itemsize apart.
+*/
+EVQUEUE_API void*
+evqueue_aligned (unsigned maxitems, unsigned itemsize, unsigned align) ;
+
+/*
+	As evqueue_aligned, with all of the queue's memory on one NUMA node (Linux):
+	bound to the given node, or with EVQUEUE_NODE_LOCAL, first-touched by the
+	calling thread so it lands on that thread's node. Create the queue from a
+	consumer thread that way to keep the events next to where they are read.
+	Pinning threads to the node is up to the caller (see queue_pin_node in
+	queue.h). Elsewhere the node is ignored.
+*/
+#define EVQUEUE_NODE_LOCAL (-1)
+
+EVQUEUE_API void*
+evqueue_node (unsigned maxitems, unsigned itemsize, unsigned align, int node) ;
+
+/*
+	Copies up to n events (and their types) into the queue.
+	Returns the number of events written, which is less than n only if the timeout expired.
+*/
 EVQUEUE_API unsigned
 evqueue_putevents(void *queue, unsigned n, void *evs, int *types, int timeout_ms);
 
+/*
+	As evqueue_putevents, with a priority per event. prios may be NULL (all 0).
+*/
+EVQUEUE_API unsigned
+evqueue_putevents_prio(void *queue, unsigned n, void *evs, int *types, int *prios, int timeout_ms);
+
+/*
+	Takes up to n events out of the queue, most urgent first, waiting until at least one is available.
+	Only events whose type is one of filters[0..nfilters) are considered. If nfilters is 0,
+	events of any type match. Returns the number of events copied to evs (types to types).
+*/
 EVQUEUE_API unsigned
 evqueue_getevents(void *queue, unsigned n, void *evs, int *types, unsigned nfilters, int *filters, int timeout_ms);
 
+/*
+	Zero-copy variants, in the spirit of queue_begin_put/queue_commit_put in queue.h.
+
+	evqueue_begin_put reserves a free slot and returns a pointer to its itemsize bytes
+	(NULL if the timeout expired). Build the event in place, then publish it with
+	evqueue_commit_put. evqueue_begin_get takes the oldest event matching the filters
+	out of the queue and returns a pointer to it in place (NULL on timeout), storing its
+	type in *type; the slot is handed back to producers by evqueue_commit_get.
+
+	The lock is not held between begin and commit, so any number of threads can be
+	building or processing events at once. A reserved slot counts against maxitems
+	until it is committed.
+*/
+EVQUEUE_API void *
+evqueue_begin_put(void *queue, int timeout_ms);
+
+EVQUEUE_API void
+evqueue_commit_put(void *queue, void *ev, int type);
+
+EVQUEUE_API void
+evqueue_commit_put_prio(void *queue, void *ev, int type, int prio);
+
+EVQUEUE_API void *
+evqueue_begin_get(void *queue, int *type, unsigned nfilters, int *filters, int timeout_ms);
+
+EVQUEUE_API void
+evqueue_commit_get(void *queue, void *ev);
+
+/*
+	Counts of how often threads blocked, how often they were signalled, and how
+	often a wakeup found nothing to do (another thread got there first, or spurious).
+*/
+struct evqueue_wakeups {
+	unsigned long long get_waits;
+	unsigned long long get_wakeups;
+	unsigned long long get_futile;
+	unsigned long long put_waits;
+	unsigned long long put_wakeups;
+	unsigned long long put_futile;
+};
+
+EVQUEUE_API void
+evqueue_wakeups(void *queue, struct evqueue_wakeups *out);
+
+/*
+	Opt-in instrumentation: compile the implementation with EVQUEUE_STATS defined to
+	have every queue keep the counters below. Without it, evqueue_stats fills in only
+	depth and wakeups and returns 0.
+
+	depth_hist[k] counts puts that left the queue holding between 2^(k-1) and 2^k - 1
+	events (the last bucket has no upper end). Lock times are in nanoseconds: wait is
+	time spent blocked acquiring the queue lock when it was already taken (contended
+	acquisitions; timeouts counts the ones that gave up), hold is time it was held.
+	get_wait_ns and put_wait_ns are time spent asleep waiting for events or slots;
+	wakeups.*_futile are the spurious wakeups. With reset, the counters (including
+	wakeups) start again from zero.
+*/
+#ifndef EVQUEUE_DEPTH_BUCKETS
+#define EVQUEUE_DEPTH_BUCKETS 16
+#endif
+
+struct evqueue_stats {
+	unsigned long long enqueued;
+	unsigned long long dequeued;
+	unsigned           depth;
+	unsigned           max_depth;
+	unsigned long long depth_hist[EVQUEUE_DEPTH_BUCKETS];
+	unsigned long long lock_acquired;
+	unsigned long long lock_contended;
+	unsigned long long lock_timeouts;
+	unsigned long long lock_wait_ns;
+	unsigned long long lock_hold_ns;
+	unsigned long long get_wait_ns;
+	unsigned long long put_wait_ns;
+	struct evqueue_wakeups wakeups;
+};
+
+EVQUEUE_API int
+evqueue_stats(void *queue, struct evqueue_stats *out, int reset);
+
+/*
+	Adaptive waiting. A thread about to block first releases the lock and polls for
+	up to spin iterations with a CPU pause instruction, then calls sched_yield up to
+	yield times, and only then sleeps on its condition variable. The number of spins
+	actually used adapts to how long recent waits were, bounded by spin. The default
+	(0, 0) always sleeps straight away, which is best when threads outnumber cores.
+*/
+EVQUEUE_API void
+evqueue_set_spin(void *queue, unsigned spin, unsigned yield);
+
+/*
+	Timeouts are measured on CLOCK_MONOTONIC, so changing the system time doesn't
+	affect them. By default every timed wait sleeps with its own deadline. With
+	coarse timeouts on, a thread that blocks waiting for events or free slots
+	instead sleeps untimed, and a timer wheel shared by all queues in the process
+	wakes it when its time is up. A single thread then tracks the time for all
+	waiters, which is cheaper when many threads wait with short timeouts. The price
+	is precision: a coarse timeout counts from when the thread first blocks, and is
+	rounded up to whole ticks of EVQUEUE_TICK_MS (default 1) milliseconds.
+*/
+EVQUEUE_API void
+evqueue_set_coarse_timeouts(void *queue, int on);
+
+/*
+	Returns an eventfd that is readable for as long as the queue holds at least one
+	event matching filters (any event if nfilters is 0), or -1 on failure. Lets a
+	consumer multiplex the queue with sockets and timers in an epoll/poll loop: when
+	the fd polls readable, call evqueue_getevents with the same filters and timeout 0.
+	Never read the fd yourself. Linux only; elsewhere this always returns -1.
+*/
+EVQUEUE_API int
+evqueue_eventfd(void *queue, unsigned nfilters, const int *filters);
+
+/*
+	Unregisters and closes an fd returned by evqueue_eventfd.
+*/
+EVQUEUE_API void
+evqueue_eventfd_close(void *queue, int fd);
+
 EVQUEUE_API void
 evqueue_free(void *queue);
 
+/*
+	Broadcast queues. Every subscriber sees every event published after it
+	subscribed (that matches its filters), in publish order. Events are written
+	once into a shared ring of maxitems slots; each subscriber has its own read
+	cursor into it, and publishers wait while the slowest cursor is maxitems
+	behind, so a subscriber that stops reading stops the publishers. Priorities
+	don't apply here.
+
+	evqueue_subscribe returns a subscriber id, or -1 if maxsubs are already
+	subscribed. An id must only be used by one thread at a time; subscribers
+	read without taking the queue lock. evqueue_receive copies up to n events out
+	and returns how many, waiting according to timeout_ms only if there are none.
+	evqueue_begin_receive instead returns a pointer to the next event, in place in
+	the ring and valid until evqueue_commit_receive, or 0 on timeout.
+*/
+EVQUEUE_API void*
+evqueue_broadcast(unsigned maxitems, unsigned itemsize, unsigned maxsubs);
+
+EVQUEUE_API unsigned
+evqueue_publish(void *queue, unsigned n, void *evs, int *types, int timeout_ms);
+
+EVQUEUE_API int
+evqueue_subscribe(void *queue, unsigned nfilters, const int *filters);
+
+EVQUEUE_API void
+evqueue_unsubscribe(void *queue, int sub);
+
+EVQUEUE_API unsigned
+evqueue_receive(void *queue, int sub, unsigned n, void *evs, int *types, int timeout_ms);
+
+EVQUEUE_API void*
+evqueue_begin_receive(void *queue, int sub, int *type, int timeout_ms);
+
+EVQUEUE_API void
+evqueue_commit_receive(void *queue, int sub);
+
+EVQUEUE_API void
+evqueue_broadcast_free(void *queue);
+
 #endif
 
 #ifdef EVQUEUE_IMPLEMENTATION
 
 #include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <time.h>
 #include "die.h"
 
-typedef struct {
+#if EVQUEUE_CACHELINE
+#define EVQ_LINE alignas(EVQUEUE_CACHELINE)
+#define EVQ_LINESZ EVQUEUE_CACHELINE
+#else
+#define EVQ_LINE
+#define EVQ_LINESZ alignof(max_align_t)
+#endif
 
-	pthread_mutex_t    m;
+#include "nodemem.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#define EVQ_NIL ((unsigned)-1)
+
+_Static_assert(EVQUEUE_NPRIO > 0 && EVQUEUE_NPRIO <= 32, "EVQUEUE_NPRIO must be between 1 and 32");
+
+/*
+	Per-slot bookkeeping. A queued slot is on two lists: the global FIFO of its priority
+	(prev/next) and the FIFO of its type and priority (tnext, see evq_fifo). A free slot
+	is on the free list (tnext).
+*/
+typedef struct {
+	unsigned long long seq;
+	int                type;
+	unsigned           prio;
+	unsigned           tnext;
+	unsigned           prev;
+	unsigned           next;
+} evq_slot;
+
+/*
+	The queued events of one type and priority. A type's FIFOs are chained through
+	next, highest priority first; only non-empty FIFOs are on the chain, the rest
+	are on the queue's free list (next). Each one holds at least one event, so a
+	pool of maxitems is enough.
+*/
+typedef struct {
+	unsigned  head;
+	unsigned  tail;
+	unsigned  prio;
+	unsigned  next;
+} evq_fifo;
+
+/*
+	An entry in the open-addressed type table. count == 0 marks an unused entry;
+	a type only has an entry while it has events queued. fifos is its chain of
+	evq_fifo, so the head of the first one is its most urgent event.
+*/
+typedef struct {
+	int       type;
+	unsigned  count;
+	unsigned  fifos;
+} evq_bucket;
+
+/*
+	A timeout on the shared timer wheel (see evqueue_set_coarse_timeouts). m is
+	set once the timer has been armed; fired is set, under *m, when it expires.
+*/
+typedef struct evq_timer {
+	struct evq_timer  *prev;
+	struct evq_timer  *next;
+	unsigned long long expiry;
+	pthread_mutex_t   *m;
+	pthread_cond_t    *c;
+	int                state;
+	int                fired;
+} evq_timer;
+
+/*
+	A thread blocked in evqueue_putevents or evqueue_getevents. Lives on that thread's stack.
+	budget is how many more items (free slots or matching events) it can still be handed.
+*/
+typedef struct evq_waiter {
+	struct evq_waiter *prev;
+	struct evq_waiter *next;
 	pthread_cond_t     c;
+	const int         *filters;
+	unsigned           nfilters;
+	unsigned           budget;
+	int                woken;
+	evq_timer          timer;
+} evq_waiter;
 
-	size_t   itemsize;
-	size_t   maxitems;
-	size_t   sz_typelist;
-	size_t   sz_events;
+typedef struct {
+	evq_waiter *head;
+	evq_waiter *tail;
+} evq_waitlist;
+
+/*
+	An eventfd registered with evqueue_eventfd. armed is set while the fd has a
+	pending count, i.e. while it polls readable.
+*/
+typedef struct evq_watch {
+	struct evq_watch *next;
+	int               fd;
+	int               armed;
+	unsigned          nfilters;
+	int               filters[];
+} evq_watch;
+
+/*
+	Laid out by who writes what: the lock and everything it guards share a line,
+	the configuration that every operation reads but nobody writes gets its own,
+	and the counters that spinning threads poll outside the lock each get one,
+	so polling them doesn't steal the line of the thread holding the lock.
+*/
+typedef struct {
+
+	EVQ_LINE pthread_mutex_t m;
 
 	unsigned nevents;
-	int      data[];
+	unsigned prios;
+	unsigned head[EVQUEUE_NPRIO];
+	unsigned tail[EVQUEUE_NPRIO];
+	unsigned freelist;
+	unsigned fifofree;
+
+	unsigned long long seq;
+
+	evq_waitlist   getters;
+	evq_waitlist   putters;
+	evq_watch     *watches;
+
+	struct evqueue_wakeups wakeups;
+
+#ifdef EVQUEUE_STATS
+	struct evqueue_stats stats;
+	unsigned long long   locked_at;
+	_Atomic unsigned long long lock_timeouts;
+#endif
+
+	EVQ_LINE size_t itemsize;
+	size_t   stride;
+	size_t   maxitems;
+	size_t   mapped;
+	unsigned typemask;
+	unsigned spin;
+	unsigned yield;
+	int      coarse;
+
+	evq_slot      *slots;
+	evq_fifo      *fifos;
+	evq_bucket    *types;
+	unsigned char *events;
+
+	EVQ_LINE _Atomic unsigned putgen;
+	EVQ_LINE _Atomic unsigned getgen;
+	EVQ_LINE _Atomic unsigned spinhint;
+
+	EVQ_LINE unsigned char data[];
 
 } evqueue_t;
 
+static size_t
+evq_align(size_t sz, size_t a)
+{
+	return (sz + a - 1) / a * a;
+}
+
+#define EVQ_NODE_NONE (-2)
 
-EVQUEUE_API void* 
+static void *
+evq_new(unsigned maxitems, unsigned itemsize, unsigned align, int node);
+
+EVQUEUE_API void*
 evqueue (unsigned maxitems, unsigned itemsize)
 {
+	return evq_new(maxitems, itemsize, 1, EVQ_NODE_NONE);
+}
+
+EVQUEUE_API void*
+evqueue_aligned (unsigned maxitems, unsigned itemsize, unsigned align)
+{
+	return evq_new(maxitems, itemsize, align, EVQ_NODE_NONE);
+}
 
-	const size_t sz_typelist = sizeof(int) * maxitems;
-	const size_t sz_events   = (size_t)itemsize * (size_t)maxitems;
+EVQUEUE_API void*
+evqueue_node (unsigned maxitems, unsigned itemsize, unsigned align, int node)
+{
+#if NODEMEM_AVAILABLE
+	return evq_new(maxitems, itemsize, align, node);
+#else
+	(void)node;
+	return evq_new(maxitems, itemsize, align, EVQ_NODE_NONE);
+#endif
+}
 
-	evqueue_t *q = malloc(sizeof(*q) + sz_typelist + sz_events);
+static void *
+evq_new(unsigned maxitems, unsigned itemsize, unsigned align, int node)
+{
+	/* the type table has a power of two at least 2 * maxitems entries, counted in unsigned */
+	if (maxitems == 0 || maxitems > 1u << 30) return 0;
+	if (align == 0 || (align & (align - 1))) return 0;
+
+	unsigned ntypes = 8;
+	while (ntypes < 2 * (size_t)maxitems) ntypes *= 2;
+
+	const size_t line      = align > EVQ_LINESZ ? align : EVQ_LINESZ;
+	const size_t stride    = evq_align(itemsize, align);
+	const size_t sz_slots  = evq_align(sizeof(evq_slot) * maxitems, line);
+	const size_t sz_fifos  = evq_align(sizeof(evq_fifo) * maxitems, line);
+	const size_t sz_types  = evq_align(sizeof(evq_bucket) * ntypes, line);
+	const size_t sz_events = stride * maxitems;
+
+	size_t sz = evq_align(sizeof(evqueue_t) + sz_slots + sz_fifos + sz_types + sz_events, line);
+	size_t mapped = 0;
+	evqueue_t *q;
+	if (node == EVQ_NODE_NONE) {
+		q = aligned_alloc(line, sz);
+	} else {
+#if NODEMEM_AVAILABLE
+		q = nodemem_map(sz, node);
+		mapped = sz;
+#else
+		q = 0;
+#endif
+	}
 	if (!q) return 0;
 
-	*q = (evqueue_t) { 
+	*q = (evqueue_t) {
 		.itemsize    = itemsize,
+		.stride      = stride,
 		.maxitems    = maxitems,
-		.sz_typelist = sz_typelist,
-		.sz_events   = sz_events,
+		.mapped      = mapped,
+		.freelist    = 0,
+		.fifofree    = 0,
+		.typemask    = ntypes - 1,
+		.slots       = (evq_slot *)   q->data,
+		.fifos       = (evq_fifo *)  (q->data + sz_slots),
+		.types       = (evq_bucket *)(q->data + sz_slots + sz_fifos),
+		.events      =                q->data + sz_slots + sz_fifos + sz_types,
 	};
 
+	for (unsigned i = 0; i < maxitems; i++) {
+		q->slots[i].tnext = i + 1 < maxitems ? i + 1 : EVQ_NIL;
+		q->fifos[i].next  = i + 1 < maxitems ? i + 1 : EVQ_NIL;
+	}
+	for (unsigned i = 0; i < ntypes; i++)
+		q->types[i].count = 0;
+
 	pthread_mutexattr_t a;
 	xassert(0 == pthread_mutexattr_init(&a));
 	xassert(0 == pthread_mutexattr_settype(&a, PTHREAD_MUTEX_ERRORCHECK));
 	xassert(0 == pthread_mutex_init(&q->m, &a));
 
-	pthread_condattr_t b;
-	xassert(0 == pthread_condattr_init(&b));
-	xassert(0 == pthread_cond_init(&q->c, &b));	
-
 	return q;
 }
 
+/*
+	Deadlines are CLOCK_MONOTONIC times, so setting the wall clock doesn't stretch
+	or cut short a timeout. Operations start with EVQ_NO_DEADLINE rather than
+	reading the clock: one that never has to block never needs the time, so the
+	deadline is only worked out (once) by evq_abstime, the first time something
+	is about to wait.
+*/
+#define EVQ_NO_DEADLINE ((struct timespec) {.tv_nsec = -1})
+
 static struct timespec
 time_now(void)
 {
 	struct timespec now;
-	xassert(TIME_UTC == timespec_get(&now, TIME_UTC));
+	xassert(0 == clock_gettime(CLOCK_MONOTONIC, &now));
 	return now;
 }
 
-static struct timespec
-get_deadline(int timeout_ms)
-{
-	struct timespec deadline = time_now();
-	if (timeout_ms > 0) {
-		size_t ns = deadline.tv_nsec + (size_t)timeout_ms * (size_t)1000000;
-		while (ns  >= 1000000000) {
-			deadline.tv_sec++;
-			ns -= 1000000000;
-		}
-		deadline.tv_nsec = ns;
+static struct timespec *
+evq_abstime(int timeout_ms, struct timespec *deadline)
+{
+	if (deadline->tv_nsec < 0) {
+		*deadline = time_now();
+		size_t ns = deadline->tv_nsec + (size_t)timeout_ms * (size_t)1000000;
+		deadline->tv_sec += ns / 1000000000;
+		deadline->tv_nsec = ns % 1000000000;
 	}
-
 	return deadline;
 }
 
+/*
+	Condition variables all time their waits against CLOCK_MONOTONIC.
+*/
+static void
+evq_cond_init(pthread_cond_t *c)
+{
+	pthread_condattr_t a;
+	xassert(0 == pthread_condattr_init(&a));
+	xassert(0 == pthread_condattr_setclock(&a, CLOCK_MONOTONIC));
+	xassert(0 == pthread_cond_init(c, &a));
+	xassert(0 == pthread_condattr_destroy(&a));
+}
 
+/*
+	Acquire the queue lock according to timeout_ms. Returns 0 if we gave up.
+	pthread_mutex_timedlock only takes CLOCK_REALTIME deadlines, so without
+	pthread_mutex_clocklock (glibc 2.30, with _GNU_SOURCE) the remaining time is
+	carried over to the wall clock just before blocking.
+*/
+static int
+evq_lock(pthread_mutex_t *m, int timeout_ms, struct timespec *deadline)
+{
+	if (timeout_ms < 0) {
+		xassert(0 == pthread_mutex_lock(m));
+		return 1;
+	}
 
-static int deadline_hit(struct timespec deadline) {
-	struct timespec now = time_now();	
-	if (now.tv_sec - deadline.tv_sec > 0) return 1; 
-	if (now.tv_sec - deadline.tv_sec == 0 && now.tv_nsec - deadline.tv_nsec > 0) return 1;
-	return 0;
+	/* 0 still waits out the lock holder, or a watcher woken by an eventfd could come back empty */
+	if (timeout_ms == 0) {
+		xassert(0 == pthread_mutex_lock(m));
+		return 1;
+	}
+
+	int rc = pthread_mutex_trylock(m);
+	if (rc == EBUSY) {
+		const struct timespec *t = evq_abstime(timeout_ms, deadline);
+#if defined(_GNU_SOURCE) && defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 30)
+		rc = pthread_mutex_clocklock(m, CLOCK_MONOTONIC, t);
+#else
+		struct timespec now = time_now(), real;
+		xassert(0 == clock_gettime(CLOCK_REALTIME, &real));
+		long long ns = (t->tv_sec - now.tv_sec) * 1000000000ll + (t->tv_nsec - now.tv_nsec);
+		if (ns < 0) ns = 0;
+		ns += real.tv_nsec;
+		real.tv_sec += ns / 1000000000;
+		real.tv_nsec = ns % 1000000000;
+		rc = pthread_mutex_timedlock(m, &real);
+#endif
+	}
+	xassert(rc == 0 || rc == EBUSY || rc == ETIMEDOUT);
+	return rc == 0;
 }
 
-EVQUEUE_API unsigned
-evqueue_putevents(void *queue, unsigned n, void *evs, int *types, int timeout_ms) 
+/*
+	Wait on a condition variable (made by evq_cond_init) according to timeout_ms
+	(which must be nonzero). Returns 0 or ETIMEDOUT.
+*/
+static int
+evq_wait(pthread_cond_t *c, pthread_mutex_t *m, int timeout_ms, struct timespec *deadline)
 {
-	evqueue_t * q = queue;
-	xassert(q);
-
-	struct timespec deadline = get_deadline(timeout_ms);
+	if (timeout_ms < 0) {
+		xassert(0 == pthread_cond_wait(c, m));
+		return 0;
+	}
 
-	unsigned char * input_events  = evs;
-	unsigned char * event_storage = ((unsigned char *)q->data) + q->sz_typelist;
+	int rc = pthread_cond_timedwait(c, m, evq_abstime(timeout_ms, deadline));
+	xassert(rc == 0 || rc == ETIMEDOUT);
+	return rc;
+}
 
-	unsigned nwritten = 0;
+/*
+	The timer wheel behind evqueue_set_coarse_timeouts. One thread per process
+	advances it every EVQUEUE_TICK_MS. A waiter arms a timer and sleeps without a
+	deadline; when the timer expires, the wheel thread takes the waiter's queue lock,
+	sets fired and signals it. Waiters read the clock once, to arm; the kernel keeps
+	a single timer for the wheel thread instead of one per sleeping waiter, and the
+	wheel only ticks while some timer is armed.
+
+	Lock order is queue lock, then wheel lock; the wheel thread drops the wheel lock
+	before taking queue locks to fire timers. A timer that is firing must not go
+	away, so evq_timer_cancel (called without the queue lock) waits for it.
+*/
+#ifndef EVQUEUE_TICK_MS
+#define EVQUEUE_TICK_MS 1
+#endif
 
-	do {	
+#define EVQ_WHEEL_SLOTS 256
 
-		// try to acquire the lock. 
-		if (timeout_ms < 0) {
-			// infinite wait
-			int rc = pthread_mutex_lock(&q->m);
-			xassert(0 == rc);
+enum { EVQ_TIMER_IDLE, EVQ_TIMER_ARMED, EVQ_TIMER_FIRING };
 
-			while (q->nevents == q->maxitems) 
-				xassert(0 == pthread_cond_wait(&q->c, &q->m));
+static struct {
+	pthread_once_t     once;
+	pthread_mutex_t    m;
+	pthread_cond_t     work;
+	pthread_cond_t     done;
+	unsigned           armed;
+	unsigned long long now;
+	struct timespec    base;
+	evq_timer         *slots[EVQ_WHEEL_SLOTS];
+} evq_wheel = {.once = PTHREAD_ONCE_INIT, .m = PTHREAD_MUTEX_INITIALIZER};
+
+static unsigned long long
+evq_wheel_ticks(void)
+{
+	const struct timespec t = time_now();
+	const long long ns = (t.tv_sec - evq_wheel.base.tv_sec) * 1000000000ll + (t.tv_nsec - evq_wheel.base.tv_nsec);
+	return ns / (EVQUEUE_TICK_MS * 1000000ll);
+}
 
-		} else if (timeout_ms == 0) {
-			// do not wait
-			int rc = pthread_mutex_trylock(&q->m);
-			xassert(rc == 0 || rc == EBUSY);
-			if (rc == EBUSY) return 0;
+static void
+evq_wheel_unlink(evq_timer *x)
+{
+	if (x->prev) x->prev->next = x->next;
+	else evq_wheel.slots[x->expiry % EVQ_WHEEL_SLOTS] = x->next;
+	if (x->next) x->next->prev = x->prev;
+}
 
-		} else {
-			// specified wait time
-			int rc = pthread_mutex_timedlock(&q->m, &deadline);
-			xassert(rc == 0 || rc == ETIMEDOUT);
-			if (rc == ETIMEDOUT) return 0;
-
-			while (q->nevents == q->maxitems) {
-				int rc = pthread_cond_timedwait(&q->c, &q->m, &deadline);
-				xassert(rc == 0 || rc == ETIMEDOUT);
-				if (rc == ETIMEDOUT) {
-					xassert(0 == pthread_mutex_unlock(&q->m));
-					return 0;
+static void *
+evq_wheel_main(void *arg)
+{
+	(void)arg;
+	xassert(0 == pthread_mutex_lock(&evq_wheel.m));
+	for (;;) {
+		while (!evq_wheel.armed)
+			xassert(0 == pthread_cond_wait(&evq_wheel.work, &evq_wheel.m));
+
+		long long ns = (evq_wheel.now + 1) * (EVQUEUE_TICK_MS * 1000000ll) + evq_wheel.base.tv_nsec;
+		struct timespec next = {
+			.tv_sec  = evq_wheel.base.tv_sec + ns / 1000000000,
+			.tv_nsec = ns % 1000000000,
+		};
+		xassert(0 == pthread_mutex_unlock(&evq_wheel.m));
+		while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0));
+		xassert(0 == pthread_mutex_lock(&evq_wheel.m));
+
+		evq_timer *firing = 0;
+		const unsigned long long now = evq_wheel_ticks();
+		while (evq_wheel.now < now) {
+			evq_wheel.now++;
+			evq_timer *x = evq_wheel.slots[evq_wheel.now % EVQ_WHEEL_SLOTS];
+			while (x) {
+				evq_timer *after = x->next;
+				if (x->expiry <= evq_wheel.now) {
+					evq_wheel_unlink(x);
+					evq_wheel.armed--;
+					x->state = EVQ_TIMER_FIRING;
+					x->next = firing;
+					firing = x;
 				}
+				x = after;
 			}
 		}
+		if (!firing) continue;
+
+		xassert(0 == pthread_mutex_unlock(&evq_wheel.m));
+		for (evq_timer *x = firing; x; x = x->next) {
+			xassert(0 == pthread_mutex_lock(x->m));
+			x->fired = 1;
+			xassert(0 == pthread_cond_signal(x->c));
+			xassert(0 == pthread_mutex_unlock(x->m));
+		}
+		xassert(0 == pthread_mutex_lock(&evq_wheel.m));
+		while (firing) {
+			evq_timer *x = firing;
+			firing = x->next;
+			x->state = EVQ_TIMER_IDLE;
+		}
+		xassert(0 == pthread_cond_broadcast(&evq_wheel.done));
+	}
+	return 0;
+}
 
-		while (nwritten < n && q->nevents < q->maxitems) {
+static void
+evq_wheel_start(void)
+{
+	evq_wheel.base = time_now();
+	evq_cond_init(&evq_wheel.work);
+	evq_cond_init(&evq_wheel.done);
+
+	pthread_attr_t a;
+	pthread_t t;
+	xassert(0 == pthread_attr_init(&a));
+	xassert(0 == pthread_attr_setdetachstate(&a, PTHREAD_CREATE_DETACHED));
+	xassert(0 == pthread_create(&t, &a, evq_wheel_main, 0));
+	xassert(0 == pthread_attr_destroy(&a));
+}
 
-			q->data[q->nevents] = types[nwritten];
+/*
+	Arms x to fire timeout_ms from now (rounded up to whole ticks, never early),
+	signalling c under m. Called with m held.
+*/
+static void
+evq_timer_arm(evq_timer *x, pthread_mutex_t *m, pthread_cond_t *c, int timeout_ms)
+{
+	xassert(0 == pthread_once(&evq_wheel.once, evq_wheel_start));
+	xassert(0 == pthread_mutex_lock(&evq_wheel.m));
+
+	/*
+		The wheel can run behind (and stops while idle), so expiry is worked out
+		from the clock, not from now. An idle wheel catches up first; nothing can be
+		in the slots it skips.
+	*/
+	const unsigned long long tick = evq_wheel_ticks();
+	if (!evq_wheel.armed) evq_wheel.now = tick;
+
+	x->m      = m;
+	x->c      = c;
+	x->fired  = 0;
+	x->state  = EVQ_TIMER_ARMED;
+	x->expiry = tick + 1 + (timeout_ms + EVQUEUE_TICK_MS - 1) / EVQUEUE_TICK_MS;
+
+	evq_timer **slot = &evq_wheel.slots[x->expiry % EVQ_WHEEL_SLOTS];
+	x->prev = 0;
+	x->next = *slot;
+	if (*slot) (*slot)->prev = x;
+	*slot = x;
+
+	if (!evq_wheel.armed++) xassert(0 == pthread_cond_signal(&evq_wheel.work));
+	xassert(0 == pthread_mutex_unlock(&evq_wheel.m));
+}
 
-			unsigned char * dst = event_storage + q->nevents * q->itemsize;
-			unsigned char * src = input_events  +   nwritten * q->itemsize;
-			memcpy(dst,src,q->itemsize);
+/*
+	Disarms x if it hasn't fired yet. Must be called without x's queue lock held.
+*/
+static void
+evq_timer_cancel(evq_timer *x)
+{
+	xassert(0 == pthread_mutex_lock(&evq_wheel.m));
+	if (x->state == EVQ_TIMER_ARMED) {
+		evq_wheel_unlink(x);
+		evq_wheel.armed--;
+		x->state = EVQ_TIMER_IDLE;
+	}
+	while (x->state == EVQ_TIMER_FIRING)
+		xassert(0 == pthread_cond_wait(&evq_wheel.done, &evq_wheel.m));
+	xassert(0 == pthread_mutex_unlock(&evq_wheel.m));
+}
 
-			nwritten++;
-			q->nevents++;
+#ifdef EVQUEUE_STATS
+#define EVQ_STAT(x) (x)
+
+static unsigned long long
+evq_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+#else
+#define EVQ_STAT(x) ((void)0)
+#endif
+
+/*
+	Take and release the lock of an evqueue_t, keeping lock statistics if enabled.
+	An uncontended acquisition costs one trylock and one clock read.
+*/
+static int
+evq_acquire(evqueue_t *q, int timeout_ms, struct timespec *deadline)
+{
+#ifdef EVQUEUE_STATS
+	int rc = pthread_mutex_trylock(&q->m);
+	xassert(rc == 0 || rc == EBUSY);
+	if (rc == 0) {
+		q->locked_at = evq_ns();
+		q->stats.lock_acquired++;
+		return 1;
+	}
+
+	const unsigned long long t = evq_ns();
+	if (!evq_lock(&q->m, timeout_ms, deadline)) {
+		atomic_fetch_add_explicit(&q->lock_timeouts, 1, memory_order_relaxed);
+		return 0;
+	}
+	q->locked_at = evq_ns();
+	q->stats.lock_acquired++;
+	q->stats.lock_contended++;
+	q->stats.lock_wait_ns += q->locked_at - t;
+	return 1;
+#else
+	return evq_lock(&q->m, timeout_ms, deadline);
+#endif
+}
+
+static void
+evq_release(evqueue_t *q)
+{
+	EVQ_STAT(q->stats.lock_hold_ns += evq_ns() - q->locked_at);
+	xassert(0 == pthread_mutex_unlock(&q->m));
+}
+
+static unsigned
+evq_hash(int type)
+{
+	unsigned h = (unsigned)type;
+	h ^= h >> 16;
+	h *= 0x45d9f3bu;
+	h ^= h >> 16;
+	return h;
+}
+
+static evq_bucket *
+evq_find(evqueue_t *q, int type)
+{
+	for (unsigned i = evq_hash(type) & q->typemask; q->types[i].count; i = (i + 1) & q->typemask)
+		if (q->types[i].type == type) return &q->types[i];
+	return 0;
+}
+
+static evq_bucket *
+evq_find_or_add(evqueue_t *q, int type)
+{
+	// the table has more than twice as many entries as there are slots, so it never fills
+	unsigned i = evq_hash(type) & q->typemask;
+	for (; q->types[i].count; i = (i + 1) & q->typemask)
+		if (q->types[i].type == type) return &q->types[i];
+
+	q->types[i] = (evq_bucket) {.type = type, .fifos = EVQ_NIL};
+	return &q->types[i];
+}
+
+static void
+evq_bucket_remove(evqueue_t *q, evq_bucket *b)
+{
+	/*
+		Linear probing with backward-shift deletion: pull later entries of the
+		probe run back into the hole, unless that would move them before their home.
+	*/
+	unsigned i = b - q->types;
+	unsigned j = i;
+	for (;;) {
+		j = (j + 1) & q->typemask;
+		if (!q->types[j].count) break;
+		unsigned home = evq_hash(q->types[j].type) & q->typemask;
+		if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+			q->types[i] = q->types[j];
+			i = j;
 		}
+	}
+	q->types[i].count = 0;
+}
 
-		xassert(0 == pthread_mutex_unlock(&q->m));
-		if (nwritten > 0) 
-			xassert(0 == pthread_cond_broadcast(&q->c));
+static int
+evq_matches(unsigned nfilters, const int *filters, int type)
+{
+	if (!nfilters) return 1;
+	for (unsigned f = 0; f < nfilters; f++)
+		if (filters[f] == type) return 1;
+	return 0;
+}
 
-	} while (nwritten < n && (timeout_ms < 0 || !deadline_hit(deadline)));
+static unsigned
+evq_pick(evqueue_t *q, unsigned nfilters, const int *filters);
 
-	return nwritten;
+static void
+evq_watch_set(evq_watch *x, int armed)
+{
+#ifdef __linux__
+	eventfd_t v;
+	int rc = armed ? eventfd_write(x->fd, 1) : eventfd_read(x->fd, &v);
+	xassert(rc == 0);
+#endif
+	x->armed = armed;
+}
 
+static void
+evq_watch_enqueued(evqueue_t *q, int type)
+{
+	for (evq_watch *x = q->watches; x; x = x->next)
+		if (!x->armed && evq_matches(x->nfilters, x->filters, type))
+			evq_watch_set(x, 1);
+}
 
+static void
+evq_watch_dequeued(evqueue_t *q, int type)
+{
+	for (evq_watch *x = q->watches; x; x = x->next)
+		if (x->armed && evq_matches(x->nfilters, x->filters, type) && EVQ_NIL == evq_pick(q, x->nfilters, x->filters))
+			evq_watch_set(x, 0);
 }
 
-EVQUEUE_API unsigned
-evqueue_getevents(void *queue, unsigned n, void *evs, int *types, unsigned nfilters, int *filters, int timeout_ms)
+static void *
+evq_slot_ptr(evqueue_t *q, unsigned s)
 {
-	evqueue_t * q = queue;
-	xassert(q);
+	return q->events + s * q->stride;
+}
 
-	struct timespec deadline = get_deadline(timeout_ms);
+static unsigned
+evq_slot_index(evqueue_t *q, void *ev)
+{
+	xassert(q->stride > 0);
+	size_t off = (unsigned char *)ev - q->events;
+	xassert(off % q->stride == 0 && off / q->stride < q->maxitems);
+	return off / q->stride;
+}
 
-	unsigned char * output_events = evs;
-	unsigned char * event_storage = ((unsigned char *)q->data) + q->sz_typelist;
+static unsigned
+evq_slot_alloc(evqueue_t *q)
+{
+	unsigned s = q->freelist;
+	if (s != EVQ_NIL) q->freelist = q->slots[s].tnext;
+	return s;
+}
 
-	unsigned ngot = 0;
+/*
+	Generation counters that spinning threads watch without the lock.
+	Only ever bumped with the lock held, so a plain load and store will do.
+*/
+static void
+evq_bump(_Atomic unsigned *gen)
+{
+	atomic_store_explicit(gen, atomic_load_explicit(gen, memory_order_relaxed) + 1, memory_order_relaxed);
+}
 
-	do {
+static void
+evq_slot_free(evqueue_t *q, unsigned s)
+{
+	q->slots[s].tnext = q->freelist;
+	q->freelist = s;
+	evq_bump(&q->getgen);
+}
 
-		// try to acquire the lock. 
-		if (timeout_ms < 0) {
-			// infinite wait
-			int rc = pthread_mutex_lock(&q->m);
-			xassert(0 == rc);
+static unsigned
+evq_topbit(unsigned m)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return 31 - __builtin_clz(m);
+#else
+	unsigned b = 0;
+	while (m >>= 1) b++;
+	return b;
+#endif
+}
 
-			while (!q->nevents) 
-				xassert(0 == pthread_cond_wait(&q->c, &q->m));
+static void
+evq_enqueue(evqueue_t *q, unsigned s, int type, int prio)
+{
+	xassert(prio >= 0 && prio < EVQUEUE_NPRIO);
+	const unsigned bit = 1u << prio;
+
+	evq_slot *sl = &q->slots[s];
+	sl->seq   = q->seq++;
+	sl->type  = type;
+	sl->prio  = prio;
+	sl->tnext = EVQ_NIL;
+	sl->next  = EVQ_NIL;
+	sl->prev  = q->prios & bit ? q->tail[prio] : EVQ_NIL;
+
+	if (sl->prev != EVQ_NIL) q->slots[sl->prev].next = s;
+	else q->head[prio] = s;
+	q->tail[prio] = s;
+	q->prios |= bit;
+
+	evq_bucket *b = evq_find_or_add(q, type);
+	unsigned *link = &b->fifos;
+	while (*link != EVQ_NIL && q->fifos[*link].prio > (unsigned)prio) link = &q->fifos[*link].next;
+	unsigned f = *link;
+	if (f != EVQ_NIL && q->fifos[f].prio == (unsigned)prio) {
+		q->slots[q->fifos[f].tail].tnext = s;
+		q->fifos[f].tail = s;
+	} else {
+		f = q->fifofree;
+		q->fifofree = q->fifos[f].next;
+		q->fifos[f] = (evq_fifo) {.head = s, .tail = s, .prio = prio, .next = *link};
+		*link = f;
+	}
+	b->count++;
 
-		} else if (timeout_ms == 0) {
-			// do not wait
-			int rc = pthread_mutex_trylock(&q->m);
-			xassert(rc == 0 || rc == EBUSY);
-			if (rc == EBUSY) return 0;
+	q->nevents++;
+	evq_bump(&q->putgen);
 
-		} else {
-			// specified wait time
-			int rc = pthread_mutex_timedlock(&q->m, &deadline);
-			xassert(rc == 0 || rc == ETIMEDOUT);
-			if (rc == ETIMEDOUT) return 0;
-
-			while (!q->nevents) {
-				int rc = pthread_cond_timedwait(&q->c, &q->m, &deadline);
-				xassert(rc == 0 || rc == ETIMEDOUT);
-				if (rc == ETIMEDOUT) {
-					xassert(0 == pthread_mutex_unlock(&q->m));
-					return 0;
-				}
-			}
-		}
+#ifdef EVQUEUE_STATS
+	q->stats.enqueued++;
+	if (q->nevents > q->stats.max_depth) q->stats.max_depth = q->nevents;
+	const unsigned k = evq_topbit(q->nevents) + 1;
+	q->stats.depth_hist[k < EVQUEUE_DEPTH_BUCKETS ? k : EVQUEUE_DEPTH_BUCKETS - 1]++;
+#endif
 
+	if (q->watches) evq_watch_enqueued(q, type);
+}
 
-		for (unsigned i = 0; i < q->nevents && ngot < n; i++) {
-			for (unsigned f = 0; f < nfilters; f++) {
-				if (q->data[f] == filters[f]) {
+/*
+	Returns the highest-priority, then oldest, queued slot whose type matches the
+	filters, or EVQ_NIL. Costs one type table lookup per filter, regardless of how
+	many events are queued.
+*/
+static unsigned
+evq_pick(evqueue_t *q, unsigned nfilters, const int *filters)
+{
+	if (!nfilters) return q->prios ? q->head[evq_topbit(q->prios)] : EVQ_NIL;
+
+	unsigned best = EVQ_NIL;
+	for (unsigned f = 0; f < nfilters; f++) {
+		evq_bucket *b = evq_find(q, filters[f]);
+		if (!b) continue;
+		unsigned c = q->fifos[b->fifos].head;
+		if (best == EVQ_NIL || q->slots[c].prio > q->slots[best].prio ||
+		    (q->slots[c].prio == q->slots[best].prio && q->slots[c].seq < q->slots[best].seq))
+			best = c;
+	}
+	return best;
+}
 
-					unsigned char * ourcopy   = event_storage +    i * q->itemsize;
-					unsigned char * theircopy = output_events + ngot * q->itemsize;
+/*
+	Removes slot s, which must be the oldest event of its type and priority, from the queue.
+*/
+static void
+evq_dequeue(evqueue_t *q, unsigned s)
+{
+	evq_slot *sl = &q->slots[s];
+	const unsigned p = sl->prio;
+
+	evq_bucket *b = evq_find(q, sl->type);
+	xassert(b);
+	unsigned *link = &b->fifos;
+	while (*link != EVQ_NIL && q->fifos[*link].prio != p) link = &q->fifos[*link].next;
+	const unsigned f = *link;
+	xassert(f != EVQ_NIL && q->fifos[f].head == s);
+	q->fifos[f].head = sl->tnext;
+	if (sl->tnext == EVQ_NIL) {
+		*link = q->fifos[f].next;
+		q->fifos[f].next = q->fifofree;
+		q->fifofree = f;
+	}
+	if (!--b->count) evq_bucket_remove(q, b);
 
-					types[ngot] = filters[f];
-					memcpy(theircopy, ourcopy, q->itemsize);
+	if (sl->prev != EVQ_NIL) q->slots[sl->prev].next = sl->next;
+	else q->head[p] = sl->next;
+	if (sl->next != EVQ_NIL) q->slots[sl->next].prev = sl->prev;
+	else q->tail[p] = sl->prev;
+	if (sl->prev == EVQ_NIL && sl->next == EVQ_NIL) q->prios &= ~(1u << p);
 
-					// compress lists
-					memmove(&q->data[i], &q->data[i+1], (q->maxitems-i) * sizeof(q->data[0]));
-					memmove(ourcopy, ourcopy+q->itemsize, (q->maxitems-i) * q->itemsize);
+	q->nevents--;
+	EVQ_STAT(q->stats.dequeued++);
 
-					ngot++;
-					q->nevents--;
-					i--; // since we're decrementing q->nevents
-					break;
-				}
-			}
+	if (q->watches) evq_watch_dequeued(q, sl->type);
+}
+
+static void
+evq_waiter_add(evq_waitlist *l, evq_waiter *w)
+{
+	w->next = 0;
+	w->prev = l->tail;
+	if (l->tail) l->tail->next = w;
+	else l->head = w;
+	l->tail = w;
+}
+
+static void
+evq_waiter_remove(evq_waitlist *l, evq_waiter *w)
+{
+	if (w->prev) w->prev->next = w->next;
+	else l->head = w->next;
+	if (w->next) w->next->prev = w->prev;
+	else l->tail = w->prev;
+}
+
+/*
+	Hands one newly available item (an event of the given type, or a free slot when
+	any is nonzero) to the longest-waiting thread that can still use it. A waiter is
+	signalled once, when it is handed its first item, and keeps absorbing items until
+	its budget is spent. So each put or get signals as many threads as it can satisfy,
+	and no more.
+*/
+static void
+evq_handoff(evq_waitlist *l, int any, int type, unsigned long long *wakeups)
+{
+	for (evq_waiter *w = l->head; w; w = w->next) {
+		if (!w->budget || !(any || evq_matches(w->nfilters, w->filters, type))) continue;
+		w->budget--;
+		if (!w->woken) {
+			w->woken = 1;
+			(*wakeups)++;
+			xassert(0 == pthread_cond_signal(&w->c));
 		}
+		return;
+	}
+}
 
-		xassert(0 == pthread_mutex_unlock(&q->m));
-		if (ngot > 0) 
-			xassert(0 == pthread_cond_broadcast(&q->c));
+/*
+	A woken consumer takes the most urgent events that match its filters, which
+	need not be the ones it was handed: an event handed to it can be left queued
+	when a more urgent one arrived after it. Once the consumer has taken its batch
+	(and left the waitlist), this wakes every waiter that still has a matching
+	event queued and hasn't been woken yet, so no event sits behind a sleeping
+	waiter that could take it.
+*/
+static void
+evq_reoffer(evqueue_t *q)
+{
+	if (!q->nevents) return;
+	for (evq_waiter *w = q->getters.head; w; w = w->next) {
+		if (w->woken || !w->budget || EVQ_NIL == evq_pick(q, w->nfilters, w->filters)) continue;
+		w->budget--;
+		w->woken = 1;
+		q->wakeups.get_wakeups++;
+		xassert(0 == pthread_cond_signal(&w->c));
+	}
+}
+
+static void
+evq_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__ ("yield");
+#endif
+}
 
-	} while (ngot < 1 && (timeout_ms < 0 || !deadline_hit(deadline)));
+/*
+	Called with the lock held by a thread that is about to block. Drops the lock,
+	spins and then yields until *gen moves (something was put, or a slot was freed)
+	or the budget runs out, then retakes the lock. Returns 0 if the lock could not
+	be retaken before the deadline; then the lock is not held.
+
+	spinhint tracks how many spins recent waits needed: it moves toward the spin
+	count that succeeded, grows when we only just missed (the yield phase succeeded),
+	and shrinks when spinning didn't help at all.
+*/
+static int
+evq_spin(evqueue_t *q, _Atomic unsigned *gen, int timeout_ms, struct timespec *deadline)
+{
+	if (!q->spin && !q->yield) return 1;
+
+	const unsigned g     = atomic_load_explicit(gen, memory_order_relaxed);
+	const unsigned hint  = atomic_load_explicit(&q->spinhint, memory_order_relaxed);
+	const unsigned limit = hint * 2 + 64 < q->spin ? hint * 2 + 64 : q->spin;
+	const unsigned yield = q->yield;
+	evq_release(q);
+
+	unsigned i = 0, y = 0;
+	while (i < limit && g == atomic_load_explicit(gen, memory_order_relaxed)) {
+		evq_pause();
+		i++;
+	}
 
-	return ngot;
+	unsigned newhint;
+	if (i < limit) {
+		newhint = hint + ((int)i - (int)hint) / 8;
+	} else {
+		while (y < yield && g == atomic_load_explicit(gen, memory_order_relaxed)) {
+			sched_yield();
+			y++;
+		}
+		newhint = y < yield ? hint + ((int)(2 * limit) - (int)hint) / 8 : hint - hint / 4;
+	}
+	atomic_store_explicit(&q->spinhint, newhint, memory_order_relaxed);
+
+	return evq_acquire(q, timeout_ms, deadline);
 }
 
-EVQUEUE_API void
-evqueue_free(void *queue)
+/*
+	Blocks the calling thread (a producer if put, else a consumer) on its own
+	condition variable until it is handed something or the deadline passes.
+	Returns 0 or ETIMEDOUT. With coarse timeouts, the first call arms w's timer
+	instead; the caller cancels it with evq_waiter_done once it has dropped the lock.
+*/
+static int
+evq_block(evqueue_t *q, int put, evq_waiter *w, unsigned budget, int timeout_ms, struct timespec *deadline)
+{
+	w->woken  = 0;
+	w->budget = budget;
+	if (put) q->wakeups.put_waits++;
+	else q->wakeups.get_waits++;
+
+	if (q->coarse && timeout_ms > 0) {
+		if (!w->timer.m) evq_timer_arm(&w->timer, &q->m, &w->c, timeout_ms);
+		if (w->timer.fired) return ETIMEDOUT;
+		timeout_ms = -1;
+	}
+
+	int rc;
+#ifdef EVQUEUE_STATS
+	const unsigned long long t = evq_ns();
+	q->stats.lock_hold_ns += t - q->locked_at;
+	rc = evq_wait(&w->c, &q->m, timeout_ms, deadline);
+	q->locked_at = evq_ns();
+	*(put ? &q->stats.put_wait_ns : &q->stats.get_wait_ns) += q->locked_at - t;
+#else
+	rc = evq_wait(&w->c, &q->m, timeout_ms, deadline);
+#endif
+	return w->timer.fired ? ETIMEDOUT : rc;
+}
+
+/*
+	Tears down a waiter that has been taken off its waitlist, once the queue lock
+	has been released.
+*/
+static void
+evq_waiter_done(evq_waiter *w)
+{
+	if (w->timer.m) evq_timer_cancel(&w->timer);
+	xassert(0 == pthread_cond_destroy(&w->c));
+}
+
+EVQUEUE_API unsigned
+evqueue_putevents(void *queue, unsigned n, void *evs, int *types, int timeout_ms)
+{
+	return evqueue_putevents_prio(queue, n, evs, types, 0, timeout_ms);
+}
+
+EVQUEUE_API unsigned
+evqueue_putevents_prio(void *queue, unsigned n, void *evs, int *types, int *prios, int timeout_ms)
 {
 	evqueue_t * q = queue;
 	xassert(q);
-	xassert(0 == pthread_mutex_destroy(&q->m));
-	xassert(0 == pthread_cond_destroy(&q->c));
-	free(q);
-}
 
+	struct timespec deadline = EVQ_NO_DEADLINE;
+	if (!evq_acquire(q, timeout_ms, &deadline)) return 0;
 
-#endif
+	unsigned char * input_events = evs;
+	unsigned nwritten = 0;
+	int rc = 0;
+	int spun = 0;
+	int waiting = 0;
+	evq_waiter w = {0};
+
+	for (;;) {
+
+		const unsigned before = nwritten;
 
+		while (nwritten < n && q->freelist != EVQ_NIL) {
+			unsigned s = evq_slot_alloc(q);
+			memcpy(evq_slot_ptr(q, s), input_events + nwritten * q->itemsize, q->itemsize);
+			evq_enqueue(q, s, types[nwritten], prios ? prios[nwritten] : 0);
+			evq_handoff(&q->getters, 0, types[nwritten], &q->wakeups.get_wakeups);
+			nwritten++;
+		}
+
+		if (waiting && rc == 0 && nwritten == before) q->wakeups.put_futile++;
+
+		if (nwritten == n || timeout_ms == 0 || rc == ETIMEDOUT) break;
+
+		if (!spun) {
+			spun = 1;
+			if (!evq_spin(q, &q->getgen, timeout_ms, &deadline)) return nwritten;
+			continue;
+		}
+
+		if (!waiting) {
+			evq_cond_init(&w.c);
+			evq_waiter_add(&q->putters, &w);
+			waiting = 1;
+		}
+
+		rc = evq_block(q, 1, &w, n - nwritten, timeout_ms, &deadline);
+	}
+
+	if (waiting) evq_waiter_remove(&q->putters, &w);
+
+	evq_release(q);
+	if (waiting) evq_waiter_done(&w);
+	return nwritten;
+}
+
+static unsigned
+evq_take(evqueue_t *q, unsigned n, unsigned char *output_events, int *types, unsigned nfilters, const int *filters)
+{
+	unsigned ngot = 0;
+	while (ngot < n) {
+		unsigned s = evq_pick(q, nfilters, filters);
+		if (s == EVQ_NIL) break;
+
+		types[ngot] = q->slots[s].type;
+		memcpy(output_events + ngot * q->itemsize, evq_slot_ptr(q, s), q->itemsize);
+
+		evq_dequeue(q, s);
+		evq_slot_free(q, s);
+		evq_handoff(&q->putters, 1, 0, &q->wakeups.put_wakeups);
+		ngot++;
+	}
+	return ngot;
+}
+
+EVQUEUE_API unsigned
+evqueue_getevents(void *queue, unsigned n, void *evs, int *types, unsigned nfilters, int *filters, int timeout_ms)
+{
+	evqueue_t * q = queue;
+	xassert(q);
+
+	struct timespec deadline = EVQ_NO_DEADLINE;
+	if (!evq_acquire(q, timeout_ms, &deadline)) return 0;
+
+	unsigned ngot = evq_take(q, n, evs, types, nfilters, filters);
+
+	if (!ngot && n && timeout_ms != 0) {
+		if (!evq_spin(q, &q->putgen, timeout_ms, &deadline)) return 0;
+		ngot = evq_take(q, n, evs, types, nfilters, filters);
+	}
+
+	evq_waiter w = {.filters = filters, .nfilters = nfilters};
+	const int waiting = !ngot && n && timeout_ms != 0;
+
+	if (waiting) {
+
+		evq_cond_init(&w.c);
+		evq_waiter_add(&q->getters, &w);
+
+		while (!ngot) {
+			int rc = evq_block(q, 0, &w, n, timeout_ms, &deadline);
+			ngot = evq_take(q, n, evs, types, nfilters, filters);
+			if (rc == ETIMEDOUT) break;
+			if (!ngot) q->wakeups.get_futile++;
+		}
+
+		evq_waiter_remove(&q->getters, &w);
+		if (ngot) evq_reoffer(q);
+	}
+
+	evq_release(q);
+	if (waiting) evq_waiter_done(&w);
+	return ngot;
+}
+
+EVQUEUE_API void *
+evqueue_begin_put(void *queue, int timeout_ms)
+{
+	evqueue_t * q = queue;
+	xassert(q);
+
+	struct timespec deadline = EVQ_NO_DEADLINE;
+	if (!evq_acquire(q, timeout_ms, &deadline)) return 0;
+
+	unsigned s = evq_slot_alloc(q);
+
+	if (s == EVQ_NIL && timeout_ms != 0) {
+		if (!evq_spin(q, &q->getgen, timeout_ms, &deadline)) return 0;
+		s = evq_slot_alloc(q);
+	}
+
+	evq_waiter w = {0};
+	const int waiting = s == EVQ_NIL && timeout_ms != 0;
+
+	if (waiting) {
+
+		evq_cond_init(&w.c);
+		evq_waiter_add(&q->putters, &w);
+
+		while (s == EVQ_NIL) {
+			int rc = evq_block(q, 1, &w, 1, timeout_ms, &deadline);
+			s = evq_slot_alloc(q);
+			if (rc == ETIMEDOUT) break;
+			if (s == EVQ_NIL) q->wakeups.put_futile++;
+		}
+
+		evq_waiter_remove(&q->putters, &w);
+	}
+
+	evq_release(q);
+	if (waiting) evq_waiter_done(&w);
+	return s == EVQ_NIL ? 0 : evq_slot_ptr(q, s);
+}
+
+EVQUEUE_API void
+evqueue_commit_put(void *queue, void *ev, int type)
+{
+	evqueue_commit_put_prio(queue, ev, type, 0);
+}
+
+EVQUEUE_API void
+evqueue_commit_put_prio(void *queue, void *ev, int type, int prio)
+{
+	evqueue_t * q = queue;
+	xassert(q);
+	unsigned s = evq_slot_index(q, ev);
+
+	evq_acquire(q, -1, 0);
+	evq_enqueue(q, s, type, prio);
+	evq_handoff(&q->getters, 0, type, &q->wakeups.get_wakeups);
+	evq_release(q);
+}
+
+EVQUEUE_API void *
+evqueue_begin_get(void *queue, int *type, unsigned nfilters, int *filters, int timeout_ms)
+{
+	evqueue_t * q = queue;
+	xassert(q);
+
+	struct timespec deadline = EVQ_NO_DEADLINE;
+	if (!evq_acquire(q, timeout_ms, &deadline)) return 0;
+
+	unsigned s = evq_pick(q, nfilters, filters);
+
+	if (s == EVQ_NIL && timeout_ms != 0) {
+		if (!evq_spin(q, &q->putgen, timeout_ms, &deadline)) return 0;
+		s = evq_pick(q, nfilters, filters);
+	}
+
+	evq_waiter w = {.filters = filters, .nfilters = nfilters};
+	const int waiting = s == EVQ_NIL && timeout_ms != 0;
+
+	if (waiting) {
+
+		evq_cond_init(&w.c);
+		evq_waiter_add(&q->getters, &w);
+
+		while (s == EVQ_NIL) {
+			int rc = evq_block(q, 0, &w, 1, timeout_ms, &deadline);
+			s = evq_pick(q, nfilters, filters);
+			if (rc == ETIMEDOUT) break;
+			if (s == EVQ_NIL) q->wakeups.get_futile++;
+		}
+
+		evq_waiter_remove(&q->getters, &w);
+	}
+
+	if (s != EVQ_NIL) {
+		*type = q->slots[s].type;
+		evq_dequeue(q, s);
+		if (waiting) evq_reoffer(q);
+	}
+
+	evq_release(q);
+	if (waiting) evq_waiter_done(&w);
+	return s == EVQ_NIL ? 0 : evq_slot_ptr(q, s);
+}
+
+EVQUEUE_API void
+evqueue_commit_get(void *queue, void *ev)
+{
+	evqueue_t * q = queue;
+	xassert(q);
+	unsigned s = evq_slot_index(q, ev);
+
+	evq_acquire(q, -1, 0);
+	evq_slot_free(q, s);
+	evq_handoff(&q->putters, 1, 0, &q->wakeups.put_wakeups);
+	evq_release(q);
+}
+
+EVQUEUE_API void
+evqueue_set_spin(void *queue, unsigned spin, unsigned yield)
+{
+	evqueue_t * q = queue;
+	xassert(q);
+	evq_acquire(q, -1, 0);
+	q->spin  = spin;
+	q->yield = yield;
+	atomic_store_explicit(&q->spinhint, spin / 2, memory_order_relaxed);
+	evq_release(q);
+}
+
+EVQUEUE_API void
+evqueue_set_coarse_timeouts(void *queue, int on)
+{
+	evqueue_t * q = queue;
+	xassert(q);
+	evq_acquire(q, -1, 0);
+	q->coarse = on;
+	evq_release(q);
+}
+
+EVQUEUE_API void
+evqueue_wakeups(void *queue, struct evqueue_wakeups *out)
+{
+	evqueue_t * q = queue;
+	xassert(q);
+	evq_acquire(q, -1, 0);
+	*out = q->wakeups;
+	evq_release(q);
+}
+
+EVQUEUE_API int
+evqueue_stats(void *queue, struct evqueue_stats *out, int reset)
+{
+	evqueue_t * q = queue;
+	xassert(q);
+	evq_acquire(q, -1, 0);
+#ifdef EVQUEUE_STATS
+	*out = q->stats;
+	out->lock_timeouts = atomic_load_explicit(&q->lock_timeouts, memory_order_relaxed);
+#else
+	*out = (struct evqueue_stats) {0};
+#endif
+	out->depth   = q->nevents;
+	out->wakeups = q->wakeups;
+	if (reset) {
+		q->wakeups = (struct evqueue_wakeups) {0};
+#ifdef EVQUEUE_STATS
+		q->stats = (struct evqueue_stats) {.max_depth = q->nevents};
+		atomic_store_explicit(&q->lock_timeouts, 0, memory_order_relaxed);
+#endif
+	}
+	evq_release(q);
+#ifdef EVQUEUE_STATS
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+EVQUEUE_API int
+evqueue_eventfd(void *queue, unsigned nfilters, const int *filters)
+{
+	evqueue_t * q = queue;
+	xassert(q);
+#ifdef __linux__
+	evq_watch *x = malloc(sizeof(*x) + nfilters * sizeof(x->filters[0]));
+	if (!x) return -1;
+	*x = (evq_watch) {.nfilters = nfilters};
+	if (nfilters) memcpy(x->filters, filters, nfilters * sizeof(x->filters[0]));
+
+	x->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (x->fd < 0) {
+		free(x);
+		return -1;
+	}
+
+	evq_acquire(q, -1, 0);
+	if (EVQ_NIL != evq_pick(q, nfilters, filters)) evq_watch_set(x, 1);
+	x->next = q->watches;
+	q->watches = x;
+	evq_release(q);
+
+	return x->fd;
+#else
+	(void)nfilters;
+	(void)filters;
+	return -1;
+#endif
+}
+
+EVQUEUE_API void
+evqueue_eventfd_close(void *queue, int fd)
+{
+	evqueue_t * q = queue;
+	xassert(q);
+
+	evq_acquire(q, -1, 0);
+	evq_watch **p = &q->watches;
+	while (*p && (*p)->fd != fd) p = &(*p)->next;
+	evq_watch *x = *p;
+	if (x) *p = x->next;
+	evq_release(q);
+
+	if (x) {
+#ifdef __linux__
+		close(x->fd);
+#endif
+		free(x);
+	}
+}
+
+EVQUEUE_API void
+evqueue_free(void *queue)
+{
+	evqueue_t * q = queue;
+	xassert(q);
+	while (q->watches) evqueue_eventfd_close(q, q->watches->fd);
+	xassert(0 == pthread_mutex_destroy(&q->m));
+#if NODEMEM_AVAILABLE
+	if (q->mapped) {
+		nodemem_unmap(q, q->mapped);
+		return;
+	}
+#endif
+	free(q);
+}
+
+/*
+	Sequence numbers count events ever published; event seq lives in slot
+	seq % maxitems. published is the next seq to be written, and each subscriber's
+	cursor the next seq it will read. Publishers hold the lock and only write seq
+	once seq - maxitems is behind every cursor, so subscribers can read everything
+	below published without the lock and only lock to sleep or to wake a publisher.
+*/
+typedef struct {
+	EVQ_LINE _Atomic unsigned long long cursor;
+	int      active;
+	unsigned nfilters;
+	int     *filters;
+} evq_sub;
+
+typedef struct {
+
+	EVQ_LINE pthread_mutex_t m;
+	pthread_cond_t  readable;
+	pthread_cond_t  writable;
+	unsigned        readers_waiting;
+
+	EVQ_LINE size_t itemsize;
+	size_t   maxitems;
+	unsigned maxsubs;
+	int           *types;
+	unsigned char *events;
+	evq_sub       *subs;
+
+	EVQ_LINE _Atomic unsigned long long published;
+	EVQ_LINE _Atomic unsigned writers_waiting;
+
+} evq_bcast;
+
+EVQUEUE_API void*
+evqueue_broadcast(unsigned maxitems, unsigned itemsize, unsigned maxsubs)
+{
+	if (maxitems == 0 || maxsubs == 0) return 0;
+
+	evq_bcast *q = aligned_alloc(alignof(evq_bcast), sizeof(*q));
+	evq_sub *subs = aligned_alloc(alignof(evq_sub), sizeof(evq_sub) * maxsubs);
+	int *types = malloc(sizeof(int) * maxitems);
+	unsigned char *events = aligned_alloc(EVQ_LINESZ, evq_align((size_t)itemsize * maxitems + 1, EVQ_LINESZ));
+	if (!q || !subs || !types || !events) {
+		free(q); free(subs); free(types); free(events);
+		return 0;
+	}
+
+	*q = (evq_bcast) {
+		.itemsize = itemsize,
+		.maxitems = maxitems,
+		.maxsubs  = maxsubs,
+		.types    = types,
+		.events   = events,
+		.subs     = subs,
+	};
+	for (unsigned i = 0; i < maxsubs; i++)
+		subs[i] = (evq_sub) {0};
+
+	xassert(0 == pthread_mutex_init(&q->m, 0));
+	evq_cond_init(&q->readable);
+	evq_cond_init(&q->writable);
+	return q;
+}
+
+/*
+	The lowest cursor of any subscriber, or published if there are none.
+*/
+static unsigned long long
+evq_bcast_slowest(evq_bcast *q)
+{
+	unsigned long long min = atomic_load(&q->published);
+	for (unsigned i = 0; i < q->maxsubs; i++) {
+		if (!q->subs[i].active) continue;
+		unsigned long long c = atomic_load(&q->subs[i].cursor);
+		if (c < min) min = c;
+	}
+	return min;
+}
+
+EVQUEUE_API unsigned
+evqueue_publish(void *queue, unsigned n, void *evs, int *types, int timeout_ms)
+{
+	evq_bcast *q = queue;
+	xassert(q);
+
+	struct timespec deadline = EVQ_NO_DEADLINE;
+	if (!evq_lock(&q->m, timeout_ms, &deadline)) return 0;
+
+	unsigned char *input_events = evs;
+	unsigned nwritten = 0;
+	int rc = 0;
+
+	while (nwritten < n) {
+		unsigned long long pub = atomic_load_explicit(&q->published, memory_order_relaxed);
+		unsigned long long room = q->maxitems - (pub - evq_bcast_slowest(q));
+
+		if (!room) {
+			if (timeout_ms == 0 || rc == ETIMEDOUT) break;
+			/* subscribers check writers_waiting after moving their cursor */
+			atomic_fetch_add(&q->writers_waiting, 1);
+			if (evq_bcast_slowest(q) + q->maxitems == pub)
+				rc = evq_wait(&q->writable, &q->m, timeout_ms, &deadline);
+			atomic_fetch_sub(&q->writers_waiting, 1);
+			continue;
+		}
+
+		for (; room && nwritten < n; room--, nwritten++, pub++) {
+			const size_t s = pub % q->maxitems;
+			q->types[s] = types[nwritten];
+			memcpy(q->events + s * q->itemsize, input_events + nwritten * q->itemsize, q->itemsize);
+		}
+		atomic_store_explicit(&q->published, pub, memory_order_release);
+		if (q->readers_waiting) xassert(0 == pthread_cond_broadcast(&q->readable));
+	}
+
+	xassert(0 == pthread_mutex_unlock(&q->m));
+	return nwritten;
+}
+
+EVQUEUE_API int
+evqueue_subscribe(void *queue, unsigned nfilters, const int *filters)
+{
+	evq_bcast *q = queue;
+	xassert(q);
+
+	int *f = 0;
+	if (nfilters) {
+		f = malloc(sizeof(int) * nfilters);
+		if (!f) return -1;
+		memcpy(f, filters, sizeof(int) * nfilters);
+	}
+
+	xassert(0 == pthread_mutex_lock(&q->m));
+	int sub = -1;
+	for (unsigned i = 0; i < q->maxsubs && sub < 0; i++) {
+		if (q->subs[i].active) continue;
+		q->subs[i].active   = 1;
+		q->subs[i].nfilters = nfilters;
+		q->subs[i].filters  = f;
+		atomic_store(&q->subs[i].cursor, atomic_load(&q->published));
+		sub = i;
+	}
+	xassert(0 == pthread_mutex_unlock(&q->m));
+
+	if (sub < 0) free(f);
+	return sub;
+}
+
+EVQUEUE_API void
+evqueue_unsubscribe(void *queue, int sub)
+{
+	evq_bcast *q = queue;
+	xassert(q && sub >= 0 && (unsigned)sub < q->maxsubs);
+
+	xassert(0 == pthread_mutex_lock(&q->m));
+	xassert(q->subs[sub].active);
+	q->subs[sub].active = 0;
+	free(q->subs[sub].filters);
+	q->subs[sub].filters = 0;
+	xassert(0 == pthread_cond_broadcast(&q->writable));
+	xassert(0 == pthread_mutex_unlock(&q->m));
+}
+
+/*
+	Moves a subscriber's cursor to c, then wakes publishers if any were waiting
+	for room; the seq_cst pair with evqueue_publish means one side always sees
+	the other.
+*/
+static void
+evq_bcast_advance(evq_bcast *q, evq_sub *s, unsigned long long c)
+{
+	atomic_store(&s->cursor, c);
+	if (atomic_load(&q->writers_waiting)) {
+		xassert(0 == pthread_mutex_lock(&q->m));
+		xassert(0 == pthread_cond_broadcast(&q->writable));
+		xassert(0 == pthread_mutex_unlock(&q->m));
+	}
+}
+
+/*
+	Waits until something past cursor c is published. Returns 0 on timeout.
+*/
+static int
+evq_bcast_await(evq_bcast *q, unsigned long long c, int timeout_ms, struct timespec *deadline)
+{
+	if (timeout_ms == 0) return 0;
+	if (!evq_lock(&q->m, timeout_ms, deadline)) return 0;
+
+	int rc = 0;
+	q->readers_waiting++;
+	while (atomic_load_explicit(&q->published, memory_order_relaxed) == c && rc != ETIMEDOUT)
+		rc = evq_wait(&q->readable, &q->m, timeout_ms, deadline);
+	q->readers_waiting--;
+
+	const int ok = atomic_load_explicit(&q->published, memory_order_relaxed) != c;
+	xassert(0 == pthread_mutex_unlock(&q->m));
+	return ok;
+}
+
+/*
+	Skips the subscriber's cursor past events it filters out, waiting for more as
+	needed. Returns the seq of its next event, or published (nothing to read) on
+	timeout.
+*/
+static unsigned long long
+evq_bcast_next(evq_bcast *q, evq_sub *s, int timeout_ms, struct timespec *deadline)
+{
+	unsigned long long c = atomic_load_explicit(&s->cursor, memory_order_relaxed);
+	for (;;) {
+		const unsigned long long pub = atomic_load_explicit(&q->published, memory_order_acquire);
+		const unsigned long long start = c;
+		while (c < pub && !evq_matches(s->nfilters, s->filters, q->types[c % q->maxitems])) c++;
+		if (c != start) evq_bcast_advance(q, s, c);
+		if (c < pub) return c;
+		if (!evq_bcast_await(q, c, timeout_ms, deadline)) return c;
+	}
+}
+
+EVQUEUE_API unsigned
+evqueue_receive(void *queue, int sub, unsigned n, void *evs, int *types, int timeout_ms)
+{
+	evq_bcast *q = queue;
+	xassert(q && sub >= 0 && (unsigned)sub < q->maxsubs && q->subs[sub].active);
+	evq_sub *s = &q->subs[sub];
+
+	struct timespec deadline = EVQ_NO_DEADLINE;
+	unsigned char *output_events = evs;
+	unsigned ngot = 0;
+
+	unsigned long long c = evq_bcast_next(q, s, timeout_ms, &deadline);
+	const unsigned long long pub = atomic_load_explicit(&q->published, memory_order_acquire);
+	for (; c < pub && ngot < n; c++) {
+		const size_t slot = c % q->maxitems;
+		if (!evq_matches(s->nfilters, s->filters, q->types[slot])) continue;
+		types[ngot] = q->types[slot];
+		memcpy(output_events + ngot * q->itemsize, q->events + slot * q->itemsize, q->itemsize);
+		ngot++;
+	}
+	if (ngot) evq_bcast_advance(q, s, c);
+	return ngot;
+}
+
+EVQUEUE_API void*
+evqueue_begin_receive(void *queue, int sub, int *type, int timeout_ms)
+{
+	evq_bcast *q = queue;
+	xassert(q && sub >= 0 && (unsigned)sub < q->maxsubs && q->subs[sub].active);
+
+	struct timespec deadline = EVQ_NO_DEADLINE;
+	unsigned long long c = evq_bcast_next(q, &q->subs[sub], timeout_ms, &deadline);
+	if (c == atomic_load_explicit(&q->published, memory_order_acquire)) return 0;
+
+	const size_t slot = c % q->maxitems;
+	*type = q->types[slot];
+	return q->events + slot * q->itemsize;
+}
+
+EVQUEUE_API void
+evqueue_commit_receive(void *queue, int sub)
+{
+	evq_bcast *q = queue;
+	xassert(q && sub >= 0 && (unsigned)sub < q->maxsubs && q->subs[sub].active);
+	evq_sub *s = &q->subs[sub];
+	evq_bcast_advance(q, s, atomic_load_explicit(&s->cursor, memory_order_relaxed) + 1);
+}
+
+EVQUEUE_API void
+evqueue_broadcast_free(void *queue)
+{
+	evq_bcast *q = queue;
+	xassert(q);
+	for (unsigned i = 0; i < q->maxsubs; i++) free(q->subs[i].filters);
+	xassert(0 == pthread_cond_destroy(&q->readable));
+	xassert(0 == pthread_cond_destroy(&q->writable));
+	xassert(0 == pthread_mutex_destroy(&q->m));
+	free(q->events);
+	free(q->types);
+	free(q->subs);
+	free(q);
+}
+
+
+#endif
+
+#ifdef EVQUEUE_SELFTEST
+
+#include <stdio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#endif
+
+enum { EV_DATA = 1, EV_CONTROL = 2, EV_RARE = 3 };
+
+static void *evq_test_q;
+
+static void *
+evq_test_rare_consumer(void *arg)
+{
+	long got = 0;
+	int filter = EV_RARE;
+	while (got < 100) {
+		long ev[4];
+		int  ty[4];
+		unsigned k = evqueue_getevents(evq_test_q, 4, ev, ty, 1, &filter, -1);
+		for (unsigned i = 0; i < k; i++) {
+			xassert(ty[i] == EV_RARE);
+			xassert(ev[i] == got);
+			got++;
+		}
+	}
+	*(long *)arg = got;
+	return 0;
+}
+
+static void *
+evq_test_data_consumer(void *arg)
+{
+	long got = 0;
+	int filter = EV_DATA;
+	while (got < 10000) {
+		long ev[16];
+		int  ty[16];
+		got += evqueue_getevents(evq_test_q, 16, ev, ty, 1, &filter, -1);
+	}
+	*(long *)arg = got;
+	return 0;
+}
+
+static void *
+evq_test_one_control(void *arg)
+{
+	long ev;
+	int ty, filter = EV_CONTROL;
+	xassert(1 == evqueue_getevents(evq_test_q, 1, &ev, &ty, 1, &filter, -1));
+	(void)arg;
+	return 0;
+}
+
+static void *
+evq_test_locked_get(void *arg)
+{
+	long ev;
+	int ty;
+	*(unsigned *)arg = evqueue_getevents(evq_test_q, 1, &ev, &ty, 0, 0, 0);
+	return 0;
+}
+
+static void *
+evq_test_zc_consumer(void *arg)
+{
+	long sum = 0;
+	for (int i = 0; i < 1000; i++) {
+		int ty;
+		unsigned char *ev = evqueue_begin_get(evq_test_q, &ty, 0, 0, -1);
+		xassert(ev);
+		for (int j = 1; j < 4096; j++) xassert(ev[j] == ev[0]);
+		sum += ev[0];
+		evqueue_commit_get(evq_test_q, ev);
+	}
+	*(long *)arg = sum;
+	return 0;
+}
+
+#define EVQ_TEST_BCAST 100000
+
+typedef struct {
+	int  sub;
+	int  mode;
+	long count;
+} evq_test_subscriber;
+
+/*
+	mode 0 receives everything in batches, mode 1 only EV_CONTROL (every third
+	event), mode 2 everything in place. All must see exactly the published order.
+*/
+static void *
+evq_test_subscriber_main(void *arg)
+{
+	evq_test_subscriber *s = arg;
+	const long step = s->mode == 1 ? 3 : 1;
+	const long want = EVQ_TEST_BCAST / step;
+	long next = 0;
+	while (s->count < want) {
+		long ev[5];
+		int ty[5];
+		unsigned got = 0;
+		if (s->mode == 2) {
+			long *p = evqueue_begin_receive(evq_test_q, s->sub, ty, -1);
+			xassert(p);
+			ev[0] = *p;
+			evqueue_commit_receive(evq_test_q, s->sub);
+			got = 1;
+		} else {
+			got = evqueue_receive(evq_test_q, s->sub, 5, ev, ty, -1);
+		}
+		for (unsigned k = 0; k < got; k++, next += step, s->count++) {
+			xassert(ev[k] == next);
+			xassert(ty[k] == (ev[k] % 3 ? EV_DATA : EV_CONTROL));
+		}
+	}
+	return 0;
+}
+
+static void *
+evq_test_late_rare(void *arg)
+{
+	struct timespec ms = {.tv_nsec = 2000000};
+	nanosleep(&ms, 0);
+	long ev = 0;
+	int ty = EV_RARE;
+	xassert(1 == evqueue_putevents(arg, 1, &ev, &ty, -1));
+	return 0;
+}
+
+static long long
+evq_test_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ll + t.tv_nsec;
+}
+
+/*
+	Waits on queue arg with a coarse timeout of 5 to 40ms, which must expire on time.
+*/
+static void *
+evq_test_coarse_waiter(void *arg)
+{
+	static _Atomic int n;
+	const int timeout = 5 + 5 * (atomic_fetch_add(&n, 1) % 8);
+	long ev;
+	int ty, f = EV_RARE;
+	const long long t0 = evq_test_ns();
+	xassert(0 == evqueue_getevents(arg, 1, &ev, &ty, 1, &f, timeout));
+	const long long dt = evq_test_ns() - t0;
+	xassert(dt >= timeout * 1000000ll && dt < (timeout + 500) * 1000000ll);
+	return 0;
+}
+
+typedef struct {
+	unsigned nfilters;
+	int      filters[2];
+	unsigned got;
+	int      type;
+	long long ns;
+} evq_test_getter;
+
+/*
+	Waits up to 10s for one event. A get that times out still takes whatever
+	matches by then, so how long it took is what tells whether it was woken.
+*/
+static void *
+evq_test_getter_main(void *arg)
+{
+	evq_test_getter *g = arg;
+	long ev;
+	const long long t0 = evq_test_ns();
+	g->got = evqueue_getevents(evq_test_q, 1, &ev, &g->type, g->nfilters, g->filters, 10000);
+	g->ns = evq_test_ns() - t0;
+	return 0;
+}
+
+static int
+evq_test_cmp(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+static void *
+evq_test_bulk_producer(void *arg)
+{
+	for (int i = 0; i < 20000; i++) {
+		long long now = evq_test_ns();
+		int ty = EV_DATA, prio = 0;
+		xassert(1 == evqueue_putevents_prio(evq_test_q, 1, &now, &ty, &prio, -1));
+		if (i % 100 == 50) {
+			ty = EV_CONTROL, prio = EVQUEUE_NPRIO - 1;
+			now = evq_test_ns();
+			xassert(1 == evqueue_putevents_prio(evq_test_q, 1, &now, &ty, &prio, -1));
+		}
+	}
+	(void)arg;
+	return 0;
+}
+
+int main (void) {
+
+	xassert(!evqueue(0, 1) && !evqueue(1u << 31, 1) && !evqueue(EVQ_NIL, 1));
+
+	/* filtered gets are FIFO within the selected types, and leave other types queued */
+	{
+		void *q = evqueue(8, sizeof(long));
+		long ev[8]  = {10, 20, 30, 40, 50, 60};
+		int  ty[8]  = {EV_DATA, EV_CONTROL, EV_DATA, EV_RARE, EV_CONTROL, EV_DATA};
+		xassert(6 == evqueue_putevents(q, 6, ev, ty, 0));
+
+		long out[8];
+		int  oty[8];
+		int  f[2] = {EV_RARE, EV_CONTROL};
+		xassert(3 == evqueue_getevents(q, 8, out, oty, 2, f, 0));
+		xassert(out[0] == 20 && out[1] == 40 && out[2] == 50);
+		xassert(oty[0] == EV_CONTROL && oty[1] == EV_RARE && oty[2] == EV_CONTROL);
+
+		xassert(0 == evqueue_getevents(q, 8, out, oty, 1, f, 0));
+		xassert(0 == evqueue_getevents(q, 8, out, oty, 1, f, 10));
+
+		xassert(3 == evqueue_getevents(q, 8, out, oty, 0, 0, 0));
+		xassert(out[0] == 10 && out[1] == 30 && out[2] == 60);
+
+		/* a full queue times out on put */
+		xassert(8 == evqueue_putevents(q, 8, ev, ty, 0));
+		xassert(0 == evqueue_putevents(q, 1, ev, ty, 10));
+		evqueue_free(q);
+	}
+
+	/* coarse timeouts: many waiters on several queues all time out via the wheel */
+	{
+		void *qs[4];
+		pthread_t t[16];
+		for (int i = 0; i < 4; i++) {
+			qs[i] = evqueue(4, sizeof(long));
+			evqueue_set_coarse_timeouts(qs[i], 1);
+		}
+		for (int i = 0; i < 16; i++)
+			xassert(0 == pthread_create(&t[i], 0, evq_test_coarse_waiter, qs[i % 4]));
+		for (int i = 0; i < 16; i++)
+			xassert(0 == pthread_join(t[i], 0));
+
+		/* a waiter that is served first cancels its timer; a full queue times out puts */
+		long ev[4] = {1, 2, 3, 4};
+		int ty[4] = {EV_DATA, EV_DATA, EV_DATA, EV_DATA};
+		xassert(4 == evqueue_putevents(qs[0], 4, ev, ty, 0));
+		xassert(0 == evqueue_putevents(qs[0], 1, ev, ty, 10));
+		xassert(0 == evqueue_begin_put(qs[0], 10));
+		xassert(4 == evqueue_getevents(qs[0], 4, ev, ty, 0, 0, 1000));
+		xassert(0 == evqueue_begin_get(qs[0], ty, 0, 0, 10));
+
+		pthread_t p;
+		int rare = EV_RARE;
+		xassert(0 == pthread_create(&p, 0, evq_test_late_rare, qs[1]));
+		xassert(1 == evqueue_getevents(qs[1], 1, ev, ty, 1, &rare, 60000));
+		xassert(0 == pthread_join(p, 0));
+
+		for (int i = 0; i < 4; i++) evqueue_free(qs[i]);
+	}
+
+	/* stats snapshots (the counters only exist when built with EVQUEUE_STATS) */
+	{
+		void *q = evqueue(8, sizeof(long));
+		long ev[8] = {0}, out[8];
+		int  ty[8] = {0}, oty[8];
+		xassert(5 == evqueue_putevents(q, 5, ev, ty, 0));
+		xassert(3 == evqueue_getevents(q, 3, out, oty, 0, 0, 0));
+		xassert(0 == evqueue_getevents(q, 8, out, oty, 1, &(int){EV_RARE}, 1));
+
+		struct evqueue_stats st;
+		if (evqueue_stats(q, &st, 1)) {
+			xassert(st.enqueued == 5 && st.dequeued == 3 && st.max_depth == 5);
+			xassert(st.depth_hist[1] == 1 && st.depth_hist[2] == 2 && st.depth_hist[3] == 2);
+			xassert(st.lock_acquired >= 3 && st.get_wait_ns >= 1000000);
+		}
+		xassert(st.depth == 2 && st.wakeups.get_waits == 1);
+
+		evqueue_stats(q, &st, 0);
+		xassert(st.depth == 2 && st.wakeups.get_waits == 0 && st.enqueued == 0);
+		evqueue_free(q);
+	}
+
+	/* aligned and node-placed queues keep slots at the requested alignment */
+	{
+		int nodes[2] = {EVQUEUE_NODE_LOCAL, 0};
+		for (int i = 0; i < 2; i++) {
+			void *q = evqueue_node(4, 3, 64, nodes[i]);
+			xassert(q);
+			char ev[6] = "abcdef", out[6];
+			int ty[2] = {EV_DATA, EV_DATA}, oty[2];
+			xassert(2 == evqueue_putevents(q, 2, ev, ty, 0));
+
+			int t;
+			char *p = evqueue_begin_get(q, &t, 0, 0, 0);
+			xassert(p && (uintptr_t)p % 64 == 0 && !memcmp(p, "abc", 3));
+			evqueue_commit_get(q, p);
+			xassert(1 == evqueue_getevents(q, 2, out, oty, 0, 0, 0) && !memcmp(out, "def", 3));
+			evqueue_free(q);
+		}
+	}
+
+#ifdef __linux__
+	/* an eventfd polls readable exactly while matching events are queued */
+	{
+		void *q = evqueue(8, sizeof(long));
+		int f = EV_CONTROL;
+		int fd = evqueue_eventfd(q, 1, &f);
+		xassert(fd >= 0);
+		struct pollfd p = {.fd = fd, .events = POLLIN};
+
+		long ev = 7, out[2];
+		int ty = EV_DATA, oty[2];
+		xassert(1 == evqueue_putevents(q, 1, &ev, &ty, 0));
+		xassert(0 == poll(&p, 1, 0));
+
+		xassert(2 == evqueue_putevents(q, 2, (long[]){1, 2}, (int[]){EV_CONTROL, EV_CONTROL}, 0));
+		xassert(1 == poll(&p, 1, 0));
+		xassert(1 == evqueue_getevents(q, 1, out, oty, 1, &f, 0));
+		xassert(1 == poll(&p, 1, 0));
+		xassert(1 == evqueue_getevents(q, 2, out, oty, 1, &f, 0));
+		xassert(0 == poll(&p, 1, 0));
+
+		/* registering while matching events are already queued arms immediately */
+		int fd_any = evqueue_eventfd(q, 0, 0);
+		struct pollfd pa = {.fd = fd_any, .events = POLLIN};
+		xassert(1 == poll(&pa, 1, 0));
+		xassert(1 == evqueue_getevents(q, 2, out, oty, 0, 0, 0));
+		xassert(0 == poll(&pa, 1, 0));
+
+		/* a readable fd means a get with timeout 0 finds the event, even while the lock is busy */
+		xassert(1 == evqueue_putevents(q, 1, &ev, &ty, 0));
+		xassert(1 == poll(&pa, 1, 0));
+		evq_test_q = q;
+		unsigned got = 0;
+		pthread_t t;
+		xassert(0 == pthread_mutex_lock(&((evqueue_t *)q)->m));
+		xassert(0 == pthread_create(&t, 0, evq_test_locked_get, &got));
+		nanosleep(&(struct timespec){.tv_nsec = 20000000}, 0);
+		xassert(0 == pthread_mutex_unlock(&((evqueue_t *)q)->m));
+		xassert(0 == pthread_join(t, 0));
+		xassert(got == 1);
+		evqueue_eventfd_close(q, fd_any);
+
+		evqueue_eventfd_close(q, fd);
+		evqueue_free(q);
+	}
+#endif
+
+	/* events built and consumed in place, 4 KB each, across threads */
+	{
+		evq_test_q = evqueue(4, 4096);
+		long sum = 0, expect = 0;
+		pthread_t t;
+		xassert(0 == pthread_create(&t, 0, evq_test_zc_consumer, &sum));
+		for (int i = 0; i < 1000; i++) {
+			unsigned char *ev = evqueue_begin_put(evq_test_q, -1);
+			xassert(ev);
+			memset(ev, i & 0xff, 4096);
+			expect += i & 0xff;
+			evqueue_commit_put(evq_test_q, ev, EV_DATA);
+		}
+		xassert(0 == pthread_join(t, 0));
+		xassert(sum == expect);
+
+		/* reserved and taken slots count against capacity until committed */
+		void *a = evqueue_begin_put(evq_test_q, 0);
+		void *b = evqueue_begin_put(evq_test_q, 0);
+		void *c = evqueue_begin_put(evq_test_q, 0);
+		void *d = evqueue_begin_put(evq_test_q, 0);
+		xassert(a && b && c && d);
+		xassert(!evqueue_begin_put(evq_test_q, 10));
+		evqueue_commit_put(evq_test_q, a, EV_DATA);
+		int ty;
+		void *g = evqueue_begin_get(evq_test_q, &ty, 0, 0, 0);
+		xassert(g == a && ty == EV_DATA);
+		xassert(!evqueue_begin_get(evq_test_q, &ty, 0, 0, 10));
+		evqueue_commit_get(evq_test_q, g);
+		xassert(a == evqueue_begin_put(evq_test_q, 0));
+
+		evqueue_free(evq_test_q);
+	}
+
+	/* higher priorities come out first, FIFO within a priority, with or without filters */
+	{
+		void *q = evqueue(8, sizeof(long));
+		long ev[5] = {0, 1, 2, 3, 4};
+		int  ty[5] = {EV_DATA, EV_CONTROL, EV_DATA, EV_CONTROL, EV_RARE};
+		int  pr[5] = {0, 5, 0, 5, 7};
+		long out[8];
+		int  oty[8];
+
+		xassert(5 == evqueue_putevents_prio(q, 5, ev, ty, pr, 0));
+		xassert(5 == evqueue_getevents(q, 8, out, oty, 0, 0, 0));
+		xassert(out[0] == 4 && out[1] == 1 && out[2] == 3 && out[3] == 0 && out[4] == 2);
+
+		int f[2] = {EV_DATA, EV_CONTROL};
+		xassert(5 == evqueue_putevents_prio(q, 5, ev, ty, pr, 0));
+		xassert(4 == evqueue_getevents(q, 8, out, oty, 2, f, 0));
+		xassert(out[0] == 1 && out[1] == 3 && out[2] == 0 && out[3] == 2);
+		xassert(1 == evqueue_getevents(q, 8, out, oty, 0, 0, 0) && out[0] == 4);
+		evqueue_free(q);
+	}
+
+	/*
+		A consumer handed an event takes a more urgent one that arrives after it;
+		the event it was handed must then go to another waiter that wants it.
+	*/
+	{
+		evq_test_q = evqueue(8, sizeof(long));
+		evq_test_getter g[2] = {
+			{.nfilters = 2, .filters = {EV_DATA, EV_CONTROL}},
+			{.nfilters = 1, .filters = {EV_DATA}},
+		};
+		pthread_t t[2];
+		struct evqueue_wakeups wk;
+		for (unsigned i = 0; i < 2; i++) {
+			xassert(0 == pthread_create(&t[i], 0, evq_test_getter_main, &g[i]));
+			do {
+				usleep(1000);
+				evqueue_wakeups(evq_test_q, &wk);
+			} while (wk.get_waits < i + 1);
+		}
+
+		long ev[2] = {0, 1};
+		int ty[2] = {EV_DATA, EV_CONTROL}, pr[2] = {0, EVQUEUE_NPRIO - 1};
+		xassert(2 == evqueue_putevents_prio(evq_test_q, 2, ev, ty, pr, -1));
+		for (int i = 0; i < 2; i++)
+			xassert(0 == pthread_join(t[i], 0));
+		xassert(g[0].got == 1 && g[0].type == EV_CONTROL);
+		xassert(g[1].got == 1 && g[1].type == EV_DATA && g[1].ns < 5000 * 1000000ll);
+		evqueue_free(evq_test_q);
+	}
+
+	/*
+		High-priority events bypass a full backlog of bulk events. The latency
+		percentiles are only reported: how they compare depends on the machine and
+		its load, and the ordering itself is checked above.
+	*/
+	{
+		evq_test_q = evqueue(256, sizeof(long long));
+		static long long lat_data[20000], lat_ctl[200];
+		int ndata = 0, nctl = 0;
+
+		pthread_t t;
+		xassert(0 == pthread_create(&t, 0, evq_test_bulk_producer, 0));
+		while (ndata < 20000 || nctl < 200) {
+			long long sent;
+			int ty;
+			xassert(1 == evqueue_getevents(evq_test_q, 1, &sent, &ty, 0, 0, -1));
+			long long l = evq_test_ns() - sent;
+			if (ty == EV_CONTROL) lat_ctl[nctl++] = l;
+			else lat_data[ndata++] = l;
+			for (volatile int spin = 0; spin < 2000; spin++);
+		}
+		xassert(0 == pthread_join(t, 0));
+
+		qsort(lat_data, ndata, sizeof(lat_data[0]), evq_test_cmp);
+		qsort(lat_ctl,  nctl,  sizeof(lat_ctl[0]),  evq_test_cmp);
+		printf("latency (us)   p50       p90       p99\n");
+		printf("bulk      %9.1f %9.1f %9.1f\n", lat_data[ndata/2]/1e3, lat_data[ndata*9/10]/1e3, lat_data[ndata*99/100]/1e3);
+		printf("control   %9.1f %9.1f %9.1f\n", lat_ctl[nctl/2]/1e3,   lat_ctl[nctl*9/10]/1e3,   lat_ctl[nctl*99/100]/1e3);
+		evqueue_free(evq_test_q);
+	}
+
+	/* many distinct types churning through the type table stay FIFO per type */
+	{
+		void *q = evqueue(64, sizeof(long));
+		long next_put[97] = {0}, next_get[97] = {0};
+		unsigned long r = 12345;
+		for (int round = 0; round < 20000; round++) {
+			r = r * 6364136223846793005ul + 1442695040888963407ul;
+			int t = (r >> 33) % 97;
+			if ((r >> 20) & 1) {
+				if (1 == evqueue_putevents(q, 1, &next_put[t], &t, 0)) next_put[t]++;
+			} else {
+				long ev;
+				int ty;
+				if (1 == evqueue_getevents(q, 1, &ev, &ty, 1, &t, 0)) {
+					xassert(ty == t && ev == next_get[t]);
+					next_get[t]++;
+				}
+			}
+		}
+		evqueue_free(q);
+	}
+
+	/* a consumer waiting for a rare type gets exactly its events, in order, amid bulk traffic */
+	{
+		evq_test_q = evqueue(64, sizeof(long));
+		evqueue_set_spin(evq_test_q, 2000, 4);
+		long rare = 0, data = 0;
+		pthread_t t1, t2;
+		xassert(0 == pthread_create(&t1, 0, evq_test_rare_consumer, &rare));
+		xassert(0 == pthread_create(&t2, 0, evq_test_data_consumer, &data));
+
+		long nrare = 0;
+		for (long i = 0; i < 10000; i++) {
+			int ty = EV_DATA;
+			xassert(1 == evqueue_putevents(evq_test_q, 1, &i, &ty, -1));
+			if (i % 100 == 0) {
+				ty = EV_RARE;
+				xassert(1 == evqueue_putevents(evq_test_q, 1, &nrare, &ty, -1));
+				nrare++;
+			}
+		}
+
+		xassert(0 == pthread_join(t1, 0));
+		xassert(0 == pthread_join(t2, 0));
+		xassert(rare == 100 && data == 10000);
+		evqueue_free(evq_test_q);
+	}
+
+	/* one event wakes one of several blocked consumers, not all of them */
+	{
+		evq_test_q = evqueue(8, sizeof(long));
+		pthread_t t[4];
+		for (int i = 0; i < 4; i++)
+			xassert(0 == pthread_create(&t[i], 0, evq_test_one_control, 0));
+
+		struct evqueue_wakeups wk;
+		do {
+			usleep(1000);
+			evqueue_wakeups(evq_test_q, &wk);
+		} while (wk.get_waits < 4);
+
+		long ev = 0;
+		int ty = EV_DATA;
+		xassert(1 == evqueue_putevents(evq_test_q, 1, &ev, &ty, -1));
+		ty = EV_CONTROL;
+		xassert(1 == evqueue_putevents(evq_test_q, 1, &ev, &ty, -1));
+		usleep(10000);
+		evqueue_wakeups(evq_test_q, &wk);
+		xassert(wk.get_wakeups == 1);
+
+		for (int i = 0; i < 3; i++)
+			xassert(1 == evqueue_putevents(evq_test_q, 1, &ev, &ty, -1));
+		for (int i = 0; i < 4; i++)
+			xassert(0 == pthread_join(t[i], 0));
+		evqueue_wakeups(evq_test_q, &wk);
+		xassert(wk.get_wakeups == 4);
+		evqueue_free(evq_test_q);
+	}
+
+	/* broadcast: every subscriber sees every event, in order, through a small ring */
+	{
+		evq_test_q = evqueue_broadcast(16, sizeof(long), 4);
+		xassert(evq_test_q);
+
+		/* events published before subscribing are not seen */
+		long ev[7];
+		int ty[7];
+		ev[0] = -1, ty[0] = EV_DATA;
+		xassert(1 == evqueue_publish(evq_test_q, 1, ev, ty, 0));
+
+		int control = EV_CONTROL;
+		evq_test_subscriber subs[3] = {
+			{evqueue_subscribe(evq_test_q, 0, 0),        0, 0},
+			{evqueue_subscribe(evq_test_q, 1, &control), 1, 0},
+			{evqueue_subscribe(evq_test_q, 0, 0),        2, 0},
+		};
+		pthread_t t[3];
+		for (int i = 0; i < 3; i++) {
+			xassert(subs[i].sub >= 0);
+			xassert(0 == pthread_create(&t[i], 0, evq_test_subscriber_main, &subs[i]));
+		}
+
+		for (long i = 0; i < EVQ_TEST_BCAST; ) {
+			unsigned n = 0;
+			for (; n < 7 && i < EVQ_TEST_BCAST; n++, i++) {
+				ev[n] = i;
+				ty[n] = i % 3 ? EV_DATA : EV_CONTROL;
+			}
+			xassert(n == evqueue_publish(evq_test_q, n, ev, ty, -1));
+		}
+		for (int i = 0; i < 3; i++)
+			xassert(0 == pthread_join(t[i], 0));
+
+		/* a subscriber that stops reading holds up publishers until it leaves */
+		int lazy = evqueue_subscribe(evq_test_q, 0, 0);
+		for (int i = 0; i < 3; i++) evqueue_unsubscribe(evq_test_q, subs[i].sub);
+		long many[16] = {0};
+		int mty[16] = {0};
+		xassert(16 == evqueue_publish(evq_test_q, 16, many, mty, 0));
+		xassert(0 == evqueue_publish(evq_test_q, 1, many, mty, 10));
+		xassert(1 == evqueue_receive(evq_test_q, lazy, 1, many, mty, 0));
+		xassert(1 == evqueue_publish(evq_test_q, 1, many, mty, 0));
+		evqueue_unsubscribe(evq_test_q, lazy);
+		xassert(16 == evqueue_publish(evq_test_q, 16, many, mty, 0));
+		evqueue_broadcast_free(evq_test_q);
+	}
+
+	printf("evqueue selftest passed\n");
+	return 0;
+}
+
+#endif
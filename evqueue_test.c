@@ -0,0 +1,3 @@
+#define EVQUEUE_IMPLEMENTATION
+#define EVQUEUE_SELFTEST
+#include "evqueue.h"
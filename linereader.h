@@ -0,0 +1,549 @@
+#ifndef LINEREADER_H
+#define LINEREADER_H
+
+/*
+	Reads line-oriented input as (ptr, len) views, with no limit on line length.
+
+	Regular files are mapped, and lines point straight into the mapping. Anything
+	else (pipes, terminals, sockets) is read in large chunks into a page-aligned
+	buffer, which grows to hold the longest line seen. Newlines are found with
+	memchr, which the C library already vectorises (SSE2/AVX2/EVEX on x86, NEON or
+	SVE on arm), and each byte is searched once however the reads split the lines.
+
+	To use: define LINEREADER_IMPLEMENTATION in one .c file before you include this
+	header. Lines are strviews from stringfns.h, of which only the declarations are
+	needed. Define LINEREADER_PARALLEL everywhere you include this header to get
+	lr_parallel as well; it needs pool.h (and so queue.h) implemented somewhere.
+*/
+
+#ifndef LINEREADER_API
+#define LINEREADER_API
+#endif
+
+/*
+	Size of each read when streaming (and of the initial buffer), and how much
+	input lr_parallel reads from a stream before handing it out to the pool.
+*/
+#ifndef LINEREADER_CHUNK
+#define LINEREADER_CHUNK (1 << 20)
+#endif
+
+#ifndef LINEREADER_BATCH
+#define LINEREADER_BATCH (16 << 20)
+#endif
+
+#include <stddef.h>
+#include "stringfns.h"
+
+typedef struct linereader linereader;
+
+/*
+	Opens path, or stdin for "-". Returns NULL with errno set on failure.
+*/
+LINEREADER_API linereader *
+lr_open (const char *path);
+
+/*
+	Reads from fd, starting at its current position, and leaves it open on
+	lr_close. A mapped file's position is not moved.
+*/
+LINEREADER_API linereader *
+lr_fdopen (int fd);
+
+LINEREADER_API void
+lr_close (linereader *r);
+
+/*
+	1 if r is reading from a mapping, 0 if it is streaming.
+*/
+LINEREADER_API int
+lr_mapped (linereader *r);
+
+/*
+	Sets *line to the next line, without its '\n' (a '\r' before it is kept;
+	sv_rtrim drops it). A last line with no newline is still returned. Returns 1,
+	0 at end of input, or -1 on a read error with errno set.
+
+	A line from a mapped file stays valid until lr_close; one from a stream, only
+	until the next call.
+*/
+LINEREADER_API int
+lr_next (linereader *r, strview *line);
+
+/*
+	Cuts buf[0..len) into n pieces of roughly equal size, each ending just after a
+	newline (or at len), so that every line lies within one piece. Writes n+1
+	offsets to cuts: piece i is [cuts[i], cuts[i+1]). Pieces can be empty when
+	lines are longer than len/n.
+*/
+LINEREADER_API void
+lr_split (const char *buf, size_t len, size_t n, size_t *cuts);
+
+#ifdef LINEREADER_PARALLEL
+#include "pool.h"
+
+/*
+	Calls fn(arg, line) for every remaining line in r, from tasks on pool p. The
+	input is split with lr_split and the pieces run concurrently, so fn must be
+	thread-safe and lines arrive in no particular order. Streams are read
+	LINEREADER_BATCH at a time. Returns 0, or -1 on a read error with errno set.
+*/
+LINEREADER_API int
+lr_parallel (linereader *r, pool *p, void (*fn)(void *arg, strview line), void *arg);
+#endif
+
+#endif
+
+#if defined(LINEREADER_SELFTEST) && !defined(LINEREADER_IMPLEMENTATION)
+#define LINEREADER_IMPLEMENTATION
+#endif
+
+#ifdef LINEREADER_IMPLEMENTATION
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "die.h"
+
+_Static_assert((LINEREADER_CHUNK & (LINEREADER_CHUNK - 1)) == 0, "LINEREADER_CHUNK must be a power of two");
+
+/*
+	Both modes keep the unread input in data[beg..end). A mapping is the whole file
+	with eof already set; a stream refills buf behind end. scan is how far the
+	search for the next newline has got, so a refill doesn't search the start of a
+	long line again.
+*/
+struct linereader {
+	int         fd;
+	int         ownfd;
+	int         eof;
+	char       *map;
+	size_t      maplen;
+	char       *buf;
+	size_t      cap;
+	size_t      beg, end, scan;
+};
+
+static const char *
+lr_data (linereader *r)
+{
+	return r->map ? r->map : r->buf;
+}
+
+LINEREADER_API linereader *
+lr_fdopen (int fd)
+{
+	linereader *r = calloc(1, sizeof *r);
+	if (!r) die("linereader: out of memory");
+	r->fd = fd;
+
+	struct stat st;
+	const off_t pos = lseek(fd, 0, SEEK_CUR);
+	if (0 == fstat(fd, &st) && S_ISREG(st.st_mode) && pos >= 0 && st.st_size > pos) {
+		void *m = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m != MAP_FAILED) {
+			madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+			r->map = m;
+			r->maplen = r->end = (size_t)st.st_size;
+			r->beg = r->scan = (size_t)pos;
+			r->eof = 1;
+			return r;
+		}
+	}
+
+	r->cap = LINEREADER_CHUNK;
+	r->buf = aligned_alloc(4096, r->cap);
+	if (!r->buf) die("linereader: out of memory");
+	return r;
+}
+
+LINEREADER_API linereader *
+lr_open (const char *path)
+{
+	if (0 == strcmp(path, "-")) return lr_fdopen(0);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return 0;
+	linereader *r = lr_fdopen(fd);
+	r->ownfd = 1;
+	return r;
+}
+
+LINEREADER_API void
+lr_close (linereader *r)
+{
+	if (!r) return;
+	if (r->map) munmap(r->map, r->maplen);
+	if (r->ownfd) close(r->fd);
+	free(r->buf);
+	free(r);
+}
+
+LINEREADER_API int
+lr_mapped (linereader *r)
+{
+	return r->map != 0;
+}
+
+/*
+	Moves the unread input to the front of buf, doubles buf if less than a chunk
+	is free behind it, and reads once. Returns the read's result.
+*/
+static ssize_t
+lr_fill (linereader *r)
+{
+	if (r->beg) {
+		memmove(r->buf, r->buf + r->beg, r->end - r->beg);
+		r->end  -= r->beg;
+		r->scan -= r->beg;
+		r->beg   = 0;
+	}
+	if (r->cap - r->end < LINEREADER_CHUNK) {
+		char *b = aligned_alloc(4096, r->cap * 2);
+		if (!b) die("linereader: out of memory");
+		memcpy(b, r->buf, r->end);
+		free(r->buf);
+		r->buf = b;
+		r->cap *= 2;
+	}
+	for (;;) {
+		ssize_t k = read(r->fd, r->buf + r->end, r->cap - r->end);
+		if (k < 0 && errno == EINTR) continue;
+		if (k == 0) r->eof = 1;
+		if (k > 0) r->end += (size_t)k;
+		return k;
+	}
+}
+
+LINEREADER_API int
+lr_next (linereader *r, strview *line)
+{
+	for (;;) {
+		const char *d = lr_data(r);
+		const char *nl = memchr(d + r->scan, '\n', r->end - r->scan);
+		if (nl) {
+			const size_t e = (size_t)(nl - d);
+			*line = (strview){d + r->beg, e - r->beg};
+			r->beg = r->scan = e + 1;
+			return 1;
+		}
+		r->scan = r->end;
+		if (r->eof) {
+			if (r->beg == r->end) return 0;
+			*line = (strview){d + r->beg, r->end - r->beg};
+			r->beg = r->end;
+			return 1;
+		}
+		if (lr_fill(r) < 0) return -1;
+	}
+}
+
+LINEREADER_API void
+lr_split (const char *buf, size_t len, size_t n, size_t *cuts)
+{
+	cuts[0] = 0;
+	for (size_t i = 1; i < n; i++) {
+		size_t at = len / n * i + len % n * i / n;
+		if (at <= cuts[i-1]) {
+			cuts[i] = cuts[i-1];
+			continue;
+		}
+		/* at is already a line start if the byte before it is a newline */
+		const char *nl = memchr(buf + at - 1, '\n', len - at + 1);
+		cuts[i] = nl ? (size_t)(nl - buf) + 1 : len;
+	}
+	cuts[n] = len;
+}
+
+#ifdef LINEREADER_PARALLEL
+
+/*
+	memrchr is a GNU extension, so use it only where it is declared.
+*/
+static const char *
+lr_memrchr (const char *p, char c, size_t n)
+{
+#if defined(_GNU_SOURCE) && defined(__GLIBC__)
+	return memrchr(p, c, n);
+#else
+	while (n--) if (p[n] == c) return p + n;
+	return 0;
+#endif
+}
+
+typedef struct {
+	const char   *buf;
+	const size_t *cuts;
+	void        (*fn)(void *arg, strview line);
+	void         *arg;
+} lr_job;
+
+static void
+lr_job_range (void *arg, size_t lo, size_t hi)
+{
+	const lr_job *j = arg;
+	for (size_t c = lo; c < hi; c++) {
+		const char *p = j->buf + j->cuts[c], *e = j->buf + j->cuts[c+1];
+		while (p < e) {
+			const char *nl = memchr(p, '\n', (size_t)(e - p));
+			if (!nl) {
+				j->fn(j->arg, (strview){p, (size_t)(e - p)});
+				break;
+			}
+			j->fn(j->arg, (strview){p, (size_t)(nl - p)});
+			p = nl + 1;
+		}
+	}
+}
+
+/*
+	Runs the lines in buf[0..len), which ends at a line boundary, across the pool:
+	a few pieces per worker so that a slow piece doesn't hold up the rest, but none
+	smaller than 64K.
+*/
+static void
+lr_run (pool *p, const char *buf, size_t len, void (*fn)(void *arg, strview line), void *arg)
+{
+	size_t n = (size_t)pool_size(p) * 8;
+	if (n > len / 65536 + 1) n = len / 65536 + 1;
+	size_t *cuts = malloc((n + 1) * sizeof *cuts);
+	if (!cuts) die("linereader: out of memory");
+	lr_split(buf, len, n, cuts);
+	lr_job j = {buf, cuts, fn, arg};
+	pool_parallel_for(p, 0, n, 1, lr_job_range, &j);
+	free(cuts);
+}
+
+LINEREADER_API int
+lr_parallel (linereader *r, pool *p, void (*fn)(void *arg, strview line), void *arg)
+{
+	while (!r->eof || r->beg < r->end) {
+		while (!r->eof && r->end - r->beg < LINEREADER_BATCH)
+			if (lr_fill(r) < 0) return -1;
+
+		/*
+			Hand out everything up to the last complete line; at eof, everything.
+			[beg, scan) is known to hold no newline, so only what was read since the
+			last search is searched.
+		*/
+		size_t cut = r->end;
+		if (!r->eof) {
+			const char *nl = lr_memrchr(lr_data(r) + r->scan, '\n', r->end - r->scan);
+			if (!nl) {
+				/* one line longer than a batch: read on until it ends */
+				r->scan = r->end;
+				if (lr_fill(r) < 0) return -1;
+				continue;
+			}
+			cut = (size_t)(nl - lr_data(r)) + 1;
+		}
+		lr_run(p, lr_data(r) + r->beg, cut - r->beg, fn, arg);
+		r->beg = r->scan = cut;
+	}
+	return 0;
+}
+
+#endif
+
+#endif
+
+#ifdef LINEREADER_SELFTEST
+
+#ifndef QUEUE_IMPLEMENTATION
+#define QUEUE_IMPLEMENTATION
+#include "queue.h"
+#endif
+
+#if defined(LINEREADER_PARALLEL) && !defined(POOL_IMPLEMENTATION)
+#define POOL_IMPLEMENTATION
+#include "pool.h"
+#endif
+
+#include <stdio.h>
+#include <threads.h>
+
+/*
+	Test input: short, empty and '\r'-terminated lines, a line several chunks long,
+	and a last line with no newline.
+*/
+static char  *lt_text;
+static size_t lt_len;
+
+static void
+lt_make (void)
+{
+	const size_t cap = 5 * LINEREADER_CHUNK;
+	lt_text = malloc(cap);
+	srand(3);
+	while (lt_len < cap - 1000) {
+		size_t n = rand() % 4 == 0 ? 0 : (size_t)rand() % 200;
+		if (lt_len == 2 * LINEREADER_CHUNK / 3) n = 3 * LINEREADER_CHUNK / 2;
+		if (n > cap - 1000 - lt_len) n = cap - 1000 - lt_len;
+		for (size_t i = 0; i < n; i++) lt_text[lt_len++] = "abc \r\t"[rand() % 6];
+		lt_text[lt_len++] = '\n';
+	}
+	memcpy(lt_text + lt_len, "no newline", 10);
+	lt_len += 10;
+}
+
+/*
+	Reads every line of r and checks each one against the text.
+*/
+static void
+lt_check_lines (linereader *r, const char *text, size_t len)
+{
+	strview line;
+	size_t pos = 0;
+	while (1 == lr_next(r, &line)) {
+		xassert(pos < len);
+		const char *nl = memchr(text + pos, '\n', len - pos);
+		const size_t e = nl ? (size_t)(nl - text) : len;
+		xassert(line.len == e - pos && !memcmp(line.ptr, text + pos, line.len));
+		pos = e + 1;
+	}
+	xassert(pos >= len);
+}
+
+static char *
+lt_tempfile (const char *text, size_t len)
+{
+	char *path = strdup("/tmp/linereader-XXXXXX");
+	int fd = mkstemp(path);
+	xassert(fd >= 0);
+	xassert((ssize_t)len == write(fd, text, len));
+	close(fd);
+	return path;
+}
+
+/*
+	Feeds the text into a pipe in uneven writes, so reads end mid-line.
+*/
+static int lt_pipe[2];
+
+static int
+lt_writer (void *arg)
+{
+	(void)arg;
+	size_t pos = 0, step = 1;
+	while (pos < lt_len) {
+		size_t n = step < lt_len - pos ? step : lt_len - pos;
+		xassert((ssize_t)n == write(lt_pipe[1], lt_text + pos, n));
+		pos += n;
+		step = step * 7 % 300007 + 1;
+	}
+	close(lt_pipe[1]);
+	return 0;
+}
+
+static linereader *
+lt_stream (thrd_t *t)
+{
+	xassert(0 == pipe(lt_pipe));
+	xassert(thrd_success == thrd_create(t, lt_writer, 0));
+	linereader *r = lr_fdopen(lt_pipe[0]);
+	xassert(!lr_mapped(r));
+	return r;
+}
+
+static void
+lt_stream_done (linereader *r, thrd_t t)
+{
+	thrd_join(t, 0);
+	lr_close(r);
+	close(lt_pipe[0]);
+}
+
+#ifdef LINEREADER_PARALLEL
+static _Atomic size_t lt_lines, lt_bytes;
+
+static void
+lt_count (void *arg, strview line)
+{
+	(void)arg;
+	atomic_fetch_add_explicit(&lt_lines, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&lt_bytes, line.len, memory_order_relaxed);
+}
+#endif
+
+int main (void) {
+	lt_make();
+
+	char *path = lt_tempfile(lt_text, lt_len);
+	linereader *r = lr_open(path);
+	xassert(r && lr_mapped(r));
+	lt_check_lines(r, lt_text, lt_len);
+	lr_close(r);
+
+	thrd_t t;
+	r = lt_stream(&t);
+	lt_check_lines(r, lt_text, lt_len);
+	lt_stream_done(r, t);
+
+	/* a mapped fd is read from its current position */
+	int fd = open(path, O_RDONLY);
+	const char *nl = memchr(lt_text + 1000, '\n', lt_len - 1000);
+	const size_t skip = (size_t)(nl - lt_text) + 1;
+	xassert(fd >= 0 && (off_t)skip == lseek(fd, (off_t)skip, SEEK_SET));
+	r = lr_fdopen(fd);
+	xassert(lr_mapped(r));
+	lt_check_lines(r, lt_text + skip, lt_len - skip);
+	lr_close(r);
+	close(fd);
+
+	/* an empty file has no lines, and "\n" has one empty line */
+	char *empty = lt_tempfile("", 0);
+	r = lr_open(empty);
+	strview line;
+	xassert(0 == lr_next(r, &line));
+	lr_close(r);
+	unlink(empty);
+	free(empty);
+	char *one = lt_tempfile("\n", 1);
+	r = lr_open(one);
+	xassert(1 == lr_next(r, &line) && line.len == 0 && 0 == lr_next(r, &line));
+	lr_close(r);
+	unlink(one);
+	free(one);
+
+	/* every piece ends at a line boundary, and the pieces cover the text */
+	size_t cuts[65];
+	for (size_t n = 1; n <= 64; n++) {
+		lr_split(lt_text, lt_len, n, cuts);
+		xassert(cuts[0] == 0 && cuts[n] == lt_len);
+		for (size_t i = 1; i < n; i++) {
+			xassert(cuts[i] >= cuts[i-1]);
+			xassert(cuts[i] == lt_len || lt_text[cuts[i]-1] == '\n');
+		}
+	}
+
+#ifdef LINEREADER_PARALLEL
+	size_t want_lines = 0, want_bytes = 0;
+	r = lr_open(path);
+	while (1 == lr_next(r, &line)) want_lines++, want_bytes += line.len;
+	lr_close(r);
+
+	pool *p = pool_create(4);
+	r = lr_open(path);
+	xassert(0 == lr_parallel(r, p, lt_count, 0));
+	xassert(lt_lines == want_lines && lt_bytes == want_bytes);
+	lr_close(r);
+
+	lt_lines = lt_bytes = 0;
+	r = lt_stream(&t);
+	xassert(0 == lr_parallel(r, p, lt_count, 0));
+	xassert(lt_lines == want_lines && lt_bytes == want_bytes);
+	lt_stream_done(r, t);
+	pool_destroy(p);
+#endif
+
+	unlink(path);
+	free(path);
+	free(lt_text);
+	printf("linereader selftest passed\n");
+	return 0;
+}
+
+#endif
@@ -0,0 +1,4 @@
+#define LINEREADER_SELFTEST
+#define LINEREADER_PARALLEL
+#define LINEREADER_BATCH (1 << 20)
+#include "linereader.h"
@@ -0,0 +1,74 @@
+#ifndef _NODEMEM_H
+#define _NODEMEM_H
+/*
+	Memory placed on a NUMA node, for queue.h and evqueue.h. Static functions, like
+	die.h, so there is nothing to link.
+
+	This needs mmap's MAP_ANONYMOUS and syscall, which glibc and musl only declare
+	in their default mode or with _DEFAULT_SOURCE / _GNU_SOURCE, not under a plain
+	-std=c11. NODEMEM_AVAILABLE says whether we have them (and are on Linux); if not,
+	nodemem_map is not defined and callers use ordinary allocation.
+*/
+#include <stdlib.h>
+
+#if defined(__linux__) && (defined(_DEFAULT_SOURCE) || defined(_GNU_SOURCE) || defined(_BSD_SOURCE))
+#define NODEMEM_AVAILABLE 1
+#else
+#define NODEMEM_AVAILABLE 0
+#endif
+
+#define NODEMEM_LOCAL    (-1)
+#define NODEMEM_MAXNODES 1024
+
+#if NODEMEM_AVAILABLE
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static inline size_t
+nodemem_size (size_t len)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	return len ? (len + page - 1) / page * page : page;
+}
+
+/*
+	Maps nodemem_size(len) zeroed bytes, bound to node if it is one, then touches
+	every page from the calling thread, so that with NODEMEM_LOCAL they land on
+	its node. Returns 0 on failure. Release with nodemem_unmap(p, len).
+*/
+static inline void *
+nodemem_map (size_t len, int node)
+{
+	if (node < NODEMEM_LOCAL || node >= NODEMEM_MAXNODES) return 0;
+
+	const size_t sz = nodemem_size(len);
+	unsigned char *p = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return 0;
+
+	if (node >= 0) {
+		/* 2 is MPOL_BIND. ENOSYS: kernel built without NUMA, so there is only one node anyway. */
+		unsigned long mask[NODEMEM_MAXNODES / (8 * sizeof(long))] = {0};
+		mask[node / (8 * sizeof(long))] = 1ul << node % (8 * sizeof(long));
+		if (syscall(SYS_mbind, p, sz, 2, mask, NODEMEM_MAXNODES, 0) && errno != ENOSYS) {
+			munmap(p, sz);
+			return 0;
+		}
+	}
+
+	const size_t page = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < sz; i += page) p[i] = 0;
+	return p;
+}
+
+static inline void
+nodemem_unmap (void *p, size_t len)
+{
+	if (p) munmap(p, nodemem_size(len));
+}
+
+#endif
+
+#endif
@@ -0,0 +1,577 @@
+#ifndef POOL_H
+#define POOL_H
+
+/*
+	A work-stealing thread pool.
+
+	Each worker has its own Chase-Lev deque: tasks a worker submits go on the bottom
+	of its deque, it runs them newest first from the bottom, and idle workers steal
+	the oldest from the top of someone else's. Tasks submitted from other threads go
+	through a shared queue_mpmc (queue.h) that every worker also takes from. Workers
+	that find nothing spin briefly, then sleep until something is submitted.
+
+	Tasks belong to a pool_group, which counts the tasks that haven't finished yet.
+	pool_wait returns once a group is empty, and runs tasks itself while it waits, so
+	tasks can submit and wait on nested groups without tying up a worker. With
+	nothing left to run it sleeps alongside the idle workers, and the task that
+	empties the group wakes it.
+
+	To use: define POOL_IMPLEMENTATION in one .c file, before you include this header.
+	It needs queue.h, with QUEUE_IMPLEMENTATION defined in some .c file.
+*/
+
+#ifndef POOL_API
+#define POOL_API
+#endif
+
+/*
+	Capacity of each worker's deque and of the shared queue, in tasks; powers of two.
+	A worker whose deque is full runs the task it was submitting on the spot.
+*/
+#ifndef POOL_DEQUE_SIZE
+#define POOL_DEQUE_SIZE 4096
+#endif
+
+#ifndef POOL_INJECT_SIZE
+#define POOL_INJECT_SIZE 4096
+#endif
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include "queue.h"
+
+typedef struct pool pool;
+
+typedef struct {
+	_Atomic size_t pending;
+} pool_group;
+
+#define POOL_GROUP_INIT {0}
+
+/*
+	Starts nthreads workers (0 for one per online CPU). Dies on failure.
+*/
+POOL_API pool *
+pool_create (unsigned nthreads);
+
+/*
+	Runs whatever is still queued, then stops the workers and frees the pool.
+*/
+POOL_API void
+pool_destroy (pool *p);
+
+POOL_API unsigned
+pool_size (pool *p);
+
+/*
+	Queues fn(arg) as part of group g.
+*/
+POOL_API void
+pool_submit (pool *p, pool_group *g, void (*fn)(void *arg), void *arg);
+
+/*
+	Returns when every task in g (including those submitted while waiting) has
+	finished, running queued tasks in the meantime.
+*/
+POOL_API void
+pool_wait (pool *p, pool_group *g);
+
+/*
+	Calls fn(arg, lo, hi) over disjoint ranges covering [begin, end), each at most
+	grain long (0 picks a grain from the pool size), and returns when all are done.
+	Ranges are split in half recursively, so idle workers steal big halves and
+	splitting spreads out across the pool instead of starting from one thread.
+*/
+POOL_API void
+pool_parallel_for (pool *p, size_t begin, size_t end, size_t grain,
+	void (*fn)(void *arg, size_t lo, size_t hi), void *arg);
+
+#endif
+
+#if defined(POOL_SELFTEST) && !defined(POOL_IMPLEMENTATION)
+#define POOL_IMPLEMENTATION
+#endif
+
+#ifdef POOL_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <threads.h>
+#include "die.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+_Static_assert((POOL_DEQUE_SIZE & (POOL_DEQUE_SIZE - 1)) == 0, "POOL_DEQUE_SIZE must be a power of two");
+
+/*
+	A task is either a plain call, fn(arg), or a parallel_for range, which splits
+	itself until it is no longer than grain and then calls range(arg, lo, hi).
+*/
+typedef struct pool_task {
+	void      (*fn)(void *arg);
+	void      (*range)(void *arg, size_t lo, size_t hi);
+	void       *arg;
+	size_t      lo, hi, grain;
+	pool_group *g;
+} pool_task;
+
+/*
+	Chase-Lev deque (as in Le, Pop, Cohen and Zappa Nardelli, "Correct and Efficient
+	Work-Stealing for Weak Memory Models"), fixed size. The owner pushes and pops at
+	bottom; thieves take from top with a CAS. The two ends are on separate lines.
+*/
+typedef struct {
+	QUEUE_LINE _Atomic ptrdiff_t top;
+	QUEUE_LINE _Atomic ptrdiff_t bottom;
+	QUEUE_LINE pool_task * _Atomic buf[POOL_DEQUE_SIZE];
+} pool_deque;
+
+typedef struct {
+	pool_deque  dq;
+	pool       *p;
+	unsigned    id;
+	unsigned    rng;
+	thrd_t      t;
+} pool_worker;
+
+struct pool {
+	unsigned          n;
+	pool_worker      *workers;
+
+	queue_mpmc        inject;
+	pool_task        *inject_slots[POOL_INJECT_SIZE];
+
+	mtx_t             m;
+	cnd_t             c;
+	int               stop;
+
+	QUEUE_LINE _Atomic size_t   pending;
+	QUEUE_LINE _Atomic unsigned sleepers;
+	_Atomic unsigned            waiters;
+};
+
+#define POOL_SPIN 64
+
+static _Thread_local pool_worker *pool_self;
+
+static int
+pool_deque_push (pool_deque *d, pool_task *t) {
+	const ptrdiff_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	const ptrdiff_t top = atomic_load_explicit(&d->top, memory_order_acquire);
+	if (b - top >= POOL_DEQUE_SIZE) return 0;
+	atomic_store_explicit(&d->buf[b & (POOL_DEQUE_SIZE - 1)], t, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	return 1;
+}
+
+static pool_task *
+pool_deque_pop (pool_deque *d) {
+	const ptrdiff_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	ptrdiff_t top = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+	pool_task *t = 0;
+	if (top <= b) {
+		t = atomic_load_explicit(&d->buf[b & (POOL_DEQUE_SIZE - 1)], memory_order_relaxed);
+		if (top == b) {
+			/* last one: race thieves for it */
+			if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+					memory_order_seq_cst, memory_order_relaxed))
+				t = 0;
+			atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+		}
+	} else {
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	}
+	return t;
+}
+
+static pool_task *
+pool_deque_steal (pool_deque *d) {
+	ptrdiff_t top = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	const ptrdiff_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if (top >= b) return 0;
+
+	pool_task *t = atomic_load_explicit(&d->buf[top & (POOL_DEQUE_SIZE - 1)], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+			memory_order_seq_cst, memory_order_relaxed))
+		return 0;
+	return t;
+}
+
+/*
+	Next task for the calling thread: its own deque first, then the shared queue,
+	then steal from the other workers starting at a random one.
+*/
+static pool_task *
+pool_find (pool *p, pool_worker *self) {
+	pool_task *t = 0;
+	unsigned slot;
+
+	if (self) t = pool_deque_pop(&self->dq);
+
+	if (!t && queue_mpmc_try_begin_get(&p->inject, &slot)) {
+		t = p->inject_slots[slot];
+		queue_mpmc_commit_get(&p->inject, slot);
+	}
+
+	if (!t) {
+		unsigned start = 0;
+		if (self) {
+			self->rng ^= self->rng << 13;
+			self->rng ^= self->rng >> 17;
+			self->rng ^= self->rng << 5;
+			start = self->rng;
+		}
+		for (unsigned i = 0; i < p->n && !t; i++) {
+			pool_worker *v = &p->workers[(start + i) % p->n];
+			if (v != self) t = pool_deque_steal(&v->dq);
+		}
+	}
+
+	if (t) atomic_fetch_sub(&p->pending, 1);
+	return t;
+}
+
+static void pool_push (pool *p, pool_task *t);
+
+/*
+	Finishes a task of group g. waiters counts the sleepers that are in pool_wait;
+	as in pool_push, they register before their last look at g->pending and this
+	drops pending before looking at waiters, so the last task sees them.
+*/
+static void
+pool_done (pool *p, pool_group *g) {
+	if (1 == atomic_fetch_sub(&g->pending, 1) && atomic_load(&p->waiters)) {
+		mtx_lock(&p->m);
+		cnd_broadcast(&p->c);
+		mtx_unlock(&p->m);
+	}
+}
+
+static void
+pool_run (pool *p, pool_task *t) {
+	if (t->range) {
+		while (t->hi - t->lo > t->grain) {
+			const size_t mid = t->lo + (t->hi - t->lo) / 2;
+			pool_task *half = malloc(sizeof(*half));
+			if (!half) die("pool_run: malloc");
+			*half = *t;
+			half->lo = mid;
+			t->hi = mid;
+			atomic_fetch_add_explicit(&t->g->pending, 1, memory_order_relaxed);
+			pool_push(p, half);
+		}
+		t->range(t->arg, t->lo, t->hi);
+	} else {
+		t->fn(t->arg);
+	}
+	pool_done(p, t->g);
+	free(t);
+}
+
+/*
+	Sleepers register under the lock before their last look at pending, and
+	pool_push bumps pending before looking at sleepers (both seq_cst), so either
+	the sleeper sees the new task or the pusher sees the sleeper and signals it.
+*/
+static void
+pool_push (pool *p, pool_task *t) {
+	pool_worker *self = pool_self && pool_self->p == p ? pool_self : 0;
+
+	atomic_fetch_add(&p->pending, 1);
+
+	if (self) {
+		if (!pool_deque_push(&self->dq, t)) {
+			atomic_fetch_sub(&p->pending, 1);
+			pool_run(p, t);
+			return;
+		}
+	} else {
+		unsigned slot = queue_mpmc_begin_put(&p->inject);
+		p->inject_slots[slot] = t;
+		queue_mpmc_commit_put(&p->inject, slot);
+	}
+
+	if (atomic_load(&p->sleepers)) {
+		mtx_lock(&p->m);
+		cnd_signal(&p->c);
+		mtx_unlock(&p->m);
+	}
+}
+
+static int
+pool_worker_main (void *arg) {
+	pool_worker *self = arg;
+	pool *p = self->p;
+	pool_self = self;
+
+	for (unsigned idle = 0;;) {
+		pool_task *t = pool_find(p, self);
+		if (t) {
+			pool_run(p, t);
+			idle = 0;
+			continue;
+		}
+		if (idle++ < POOL_SPIN) {
+			thrd_yield();
+			continue;
+		}
+
+		mtx_lock(&p->m);
+		atomic_fetch_add(&p->sleepers, 1);
+		while (!atomic_load(&p->pending) && !p->stop)
+			cnd_wait(&p->c, &p->m);
+		atomic_fetch_sub(&p->sleepers, 1);
+		const int stop = p->stop && !atomic_load(&p->pending);
+		mtx_unlock(&p->m);
+		if (stop) break;
+		idle = 0;
+	}
+	return 0;
+}
+
+POOL_API pool *
+pool_create (unsigned nthreads) {
+	if (!nthreads) {
+#ifdef __linux__
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = n > 0 ? n : 1;
+#else
+		nthreads = 4;
+#endif
+	}
+
+	pool *p = aligned_alloc(alignof(pool), sizeof(pool));
+	if (!p) die("pool_create: aligned_alloc");
+	*p = (pool) {.n = nthreads};
+
+	p->workers = aligned_alloc(alignof(pool_worker), nthreads * sizeof(pool_worker));
+	if (!p->workers) die("pool_create: aligned_alloc");
+
+	queue_mpmc_init(&p->inject, POOL_INJECT_SIZE);
+	if (thrd_success != mtx_init(&p->m, mtx_plain)) die("pool_create: mtx_init");
+	if (thrd_success != cnd_init(&p->c)) die("pool_create: cnd_init");
+
+	for (unsigned i = 0; i < nthreads; i++) {
+		pool_worker *w = &p->workers[i];
+		atomic_init(&w->dq.top, 0);
+		atomic_init(&w->dq.bottom, 0);
+		w->p   = p;
+		w->id  = i;
+		w->rng = 2654435761u * (i + 1);
+	}
+	for (unsigned i = 0; i < nthreads; i++)
+		if (thrd_success != thrd_create(&p->workers[i].t, pool_worker_main, &p->workers[i]))
+			die("pool_create: thrd_create");
+	return p;
+}
+
+POOL_API void
+pool_destroy (pool *p) {
+	mtx_lock(&p->m);
+	p->stop = 1;
+	cnd_broadcast(&p->c);
+	mtx_unlock(&p->m);
+
+	for (unsigned i = 0; i < p->n; i++) thrd_join(p->workers[i].t, 0);
+
+	queue_mpmc_destroy(&p->inject);
+	mtx_destroy(&p->m);
+	cnd_destroy(&p->c);
+	free(p->workers);
+	free(p);
+}
+
+POOL_API unsigned
+pool_size (pool *p) {
+	return p->n;
+}
+
+POOL_API void
+pool_submit (pool *p, pool_group *g, void (*fn)(void *arg), void *arg) {
+	pool_task *t = malloc(sizeof(*t));
+	if (!t) die("pool_submit: malloc");
+	*t = (pool_task) {.fn = fn, .arg = arg, .g = g};
+	atomic_fetch_add_explicit(&g->pending, 1, memory_order_relaxed);
+	pool_push(p, t);
+}
+
+POOL_API void
+pool_wait (pool *p, pool_group *g) {
+	pool_worker *self = pool_self && pool_self->p == p ? pool_self : 0;
+	unsigned idle = 0;
+	while (atomic_load(&g->pending)) {
+		pool_task *t = pool_find(p, self);
+		if (t) {
+			pool_run(p, t);
+			idle = 0;
+			continue;
+		}
+		if (idle++ < POOL_SPIN) {
+			thrd_yield();
+			continue;
+		}
+
+		/* a sleeper, so that new tasks wake us to help, and a waiter for pool_done */
+		mtx_lock(&p->m);
+		atomic_fetch_add(&p->sleepers, 1);
+		atomic_fetch_add(&p->waiters, 1);
+		while (atomic_load(&g->pending) && !atomic_load(&p->pending))
+			cnd_wait(&p->c, &p->m);
+		atomic_fetch_sub(&p->waiters, 1);
+		atomic_fetch_sub(&p->sleepers, 1);
+		mtx_unlock(&p->m);
+		idle = 0;
+	}
+}
+
+POOL_API void
+pool_parallel_for (pool *p, size_t begin, size_t end, size_t grain,
+	void (*fn)(void *arg, size_t lo, size_t hi), void *arg) {
+
+	if (begin >= end) return;
+	if (!grain) {
+		grain = (end - begin) / (8 * (size_t)p->n);
+		if (!grain) grain = 1;
+	}
+
+	pool_group g = POOL_GROUP_INIT;
+	pool_task *t = malloc(sizeof(*t));
+	if (!t) die("pool_parallel_for: malloc");
+	*t = (pool_task) {.range = fn, .arg = arg, .lo = begin, .hi = end, .grain = grain, .g = &g};
+	atomic_fetch_add_explicit(&g.pending, 1, memory_order_relaxed);
+	pool_run(p, t);
+	pool_wait(p, &g);
+}
+
+#endif
+
+#ifdef POOL_SELFTEST
+
+#ifndef QUEUE_IMPLEMENTATION
+#define QUEUE_IMPLEMENTATION
+#include "queue.h"
+#endif
+
+#include <stdio.h>
+
+static pool *pt_pool;
+
+/*
+	parallel_for touches every index exactly once.
+*/
+#define PT_N 3000000
+static _Atomic unsigned char pt_seen[PT_N];
+static _Atomic size_t pt_sum;
+
+static void
+pt_range (void *arg, size_t lo, size_t hi) {
+	(void)arg;
+	size_t s = 0;
+	for (size_t i = lo; i < hi; i++) {
+		xassert(0 == atomic_fetch_add_explicit(&pt_seen[i], 1, memory_order_relaxed));
+		s += i;
+	}
+	atomic_fetch_add(&pt_sum, s);
+}
+
+/*
+	Nested fork/join: every call waits on its own group of two children.
+*/
+typedef struct { int n; long result; } pt_fib;
+
+static void
+pt_fib_task (void *arg) {
+	pt_fib *f = arg;
+	if (f->n < 2) {
+		f->result = f->n;
+		return;
+	}
+	pt_fib a = {f->n - 1, 0}, b = {f->n - 2, 0};
+	pool_group g = POOL_GROUP_INIT;
+	pool_submit(pt_pool, &g, pt_fib_task, &a);
+	pool_submit(pt_pool, &g, pt_fib_task, &b);
+	pool_wait(pt_pool, &g);
+	f->result = a.result + b.result;
+}
+
+/*
+	Several outside threads submitting through the shared queue at once.
+*/
+#define PT_OUTSIDE 4
+#define PT_OUTSIDE_TASKS 20000
+static _Atomic long pt_count;
+
+static void
+pt_inc (void *arg) {
+	(void)arg;
+	atomic_fetch_add_explicit(&pt_count, 1, memory_order_relaxed);
+}
+
+static _Atomic int pt_started;
+
+static void
+pt_slow (void *arg) {
+	(void)arg;
+	atomic_store(&pt_started, 1);
+	thrd_sleep(&(struct timespec){.tv_nsec = 200000000}, 0);
+}
+
+static double
+pt_cpu_ms (void) {
+	struct timespec t;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static int
+pt_outside (void *arg) {
+	(void)arg;
+	pool_group g = POOL_GROUP_INIT;
+	for (int i = 0; i < PT_OUTSIDE_TASKS; i++) pool_submit(pt_pool, &g, pt_inc, 0);
+	pool_wait(pt_pool, &g);
+	return 0;
+}
+
+int main (void) {
+	pt_pool = pool_create(4);
+
+	pool_parallel_for(pt_pool, 0, PT_N, 0, pt_range, 0);
+	xassert(pt_sum == (size_t)PT_N * (PT_N - 1) / 2);
+	for (size_t i = 0; i < PT_N; i++) xassert(pt_seen[i] == 1);
+
+	/* a grain of 1 puts one task per index through the deques */
+	atomic_store(&pt_sum, 0);
+	for (size_t i = 0; i < PT_N; i++) atomic_store(&pt_seen[i], 0);
+	pool_parallel_for(pt_pool, 0, 100000, 1, pt_range, 0);
+	xassert(pt_sum == (size_t)100000 * 99999 / 2);
+
+	pt_fib f = {22, 0};
+	pool_group g = POOL_GROUP_INIT;
+	pool_submit(pt_pool, &g, pt_fib_task, &f);
+	pool_wait(pt_pool, &g);
+	xassert(f.result == 17711);
+
+	thrd_t t[PT_OUTSIDE];
+	for (int i = 0; i < PT_OUTSIDE; i++) thrd_create(&t[i], pt_outside, 0);
+	for (int i = 0; i < PT_OUTSIDE; i++) thrd_join(t[i], 0);
+	xassert(pt_count == PT_OUTSIDE * PT_OUTSIDE_TASKS);
+
+	/* waiting from outside the pool on a task that takes a while sleeps, not polls */
+	pool_submit(pt_pool, &g, pt_slow, 0);
+	while (!atomic_load(&pt_started)) thrd_yield();
+	const double cpu = pt_cpu_ms();
+	pool_wait(pt_pool, &g);
+	printf("waiting 200ms for a task took %.2fms of CPU\n", pt_cpu_ms() - cpu);
+
+	pool_destroy(pt_pool);
+	printf("pool selftest passed\n");
+	return 0;
+}
+
+#endif
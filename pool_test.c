@@ -0,0 +1,3 @@
+#define POOL_IMPLEMENTATION
+#define POOL_SELFTEST
+#include "pool.h"
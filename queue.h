@@ -6,21 +6,153 @@
 #endif
 
 #include <threads.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
 
+/*
+	Producer-side and consumer-side indexes live on separate cache lines of this
+	size, so the two sides don't keep stealing one line from each other. The queue
+	structs are therefore cache-line aligned; use aligned_alloc to put one on the
+	heap. Define as 0 to pack them together instead.
+*/
+#ifndef QUEUE_CACHELINE
+#define QUEUE_CACHELINE 64
+#endif
+
+#if QUEUE_CACHELINE
+#define QUEUE_LINE alignas(QUEUE_CACHELINE)
+#else
+#define QUEUE_LINE
+#endif
+
+/*
+	Opt-in instrumentation: compile the implementation (and every file that uses
+	the queue struct) with QUEUE_STATS defined to have each queue keep the counters
+	below; queue_stats returns 0 and fills in only depth without it.
+
+	depth counts occupied slots, queued or claimed. depth_hist[k] counts commits that
+	left depth between 2^(k-1) and 2^k - 1 (the last bucket has no upper end). Times
+	are in nanoseconds: lock_wait_ns is time spent acquiring the lock when it was
+	already taken (lock_contended times), lock_hold_ns time it was held, and the
+	_wait_ns fields time asleep waiting for a free slot or an item. spurious counts
+	wakeups after which the thread still had to wait. Covers the locked queue only;
+	queue_spsc and queue_mpmc have no lock to instrument.
+*/
+#ifndef QUEUE_DEPTH_BUCKETS
+#define QUEUE_DEPTH_BUCKETS 16
+#endif
+
+struct queue_stats {
+	unsigned long long enqueued;
+	unsigned long long dequeued;
+	unsigned           depth;
+	unsigned           max_depth;
+	unsigned long long depth_hist[QUEUE_DEPTH_BUCKETS];
+	unsigned long long lock_acquired;
+	unsigned long long lock_contended;
+	unsigned long long lock_wait_ns;
+	unsigned long long lock_hold_ns;
+	unsigned long long put_waits;
+	unsigned long long get_waits;
+	unsigned long long put_wait_ns;
+	unsigned long long get_wait_ns;
+	unsigned long long spurious;
+};
+
+/*
+	Going around the ring from r: [r, pr) is claimed by consumers, [pr, w) is queued,
+	[w, pw) is claimed by producers, and the rest is free. done[] marks claimed slots
+	whose owner has finished with them but that can't be retired yet because an
+	earlier slot is still out.
+
+	The indexes are atomic so that waiters can watch them without the lock while
+	spinning (see queue_set_spin); they are only ever modified with the lock held.
+*/
 typedef struct {
 
-	mtx_t           m;
-	cnd_t           c;
-	unsigned short  r, w, sz;
+	QUEUE_LINE mtx_t  m;
+	cnd_t             c;
+	unsigned          sz;
+	unsigned char    *done;
+	unsigned          spin, yield;
+#ifdef QUEUE_STATS
+	struct queue_stats stats;
+	unsigned long long locked_at;
+#endif
+
+	QUEUE_LINE _Atomic unsigned pw, w;
+	QUEUE_LINE _Atomic unsigned pr, r;
+	QUEUE_LINE _Atomic unsigned spinhint;
 
 } queue;
 
 QUEUE_API void
-queue_init (queue *q, unsigned short sz);
+queue_init (queue *q, unsigned sz);
 
 QUEUE_API void
 queue_destroy (queue *q);
 
+/*
+	Copies out the queue's statistics (see QUEUE_STATS), then zeroes them if reset.
+	Returns whether statistics are compiled in.
+*/
+QUEUE_API int
+queue_stats (queue *q, struct queue_stats *out, int reset);
+
+/*
+	Allocates a slot array for sz items of itemsize bytes, starting on a cache line
+	so that no other data shares a line with the first or last slot. Release it
+	with free. Dies on allocation failure.
+*/
+QUEUE_API void *
+queue_alloc_slots (unsigned sz, size_t itemsize);
+
+/*
+	NUMA placement (Linux). queue_alloc_slots_node is queue_alloc_slots with the
+	pages bound to the given memory node. With QUEUE_NODE_LOCAL instead, the pages
+	are touched by the calling thread and so land on its node: call it from the
+	consumer thread (or a thread pinned next to it) for first-touch placement on the
+	consumer side. Release with queue_free_slots_node. Elsewhere, and under a strict
+	-std=c11 without _DEFAULT_SOURCE or _GNU_SOURCE (see nodemem.h), these fall
+	back to queue_alloc_slots and free, and the pinning calls below to failing.
+
+	queue_pin_node restricts the calling thread to the CPUs of a node, and
+	queue_pin_cpu to one CPU; both return 0, or -1 if that failed.
+	queue_current_node returns the node the calling thread is running on, or -1.
+	queue_node_count returns the number of the highest online node plus one.
+*/
+#define QUEUE_NODE_LOCAL (-1)
+
+QUEUE_API void *
+queue_alloc_slots_node (unsigned sz, size_t itemsize, int node);
+
+QUEUE_API void
+queue_free_slots_node (void *slots, unsigned sz, size_t itemsize);
+
+QUEUE_API int
+queue_pin_node (int node);
+
+QUEUE_API int
+queue_pin_cpu (int cpu);
+
+QUEUE_API int
+queue_current_node (void);
+
+QUEUE_API int
+queue_node_count (void);
+
+/*
+	Adaptive waiting. When queue_begin_put finds the queue full (or queue_begin_get
+	finds it empty), it first polls for up to spin iterations with a CPU pause
+	instruction, then calls thrd_yield up to yield times, and only then sleeps on
+	the condition variable. The number of spins actually used adapts to how long
+	waits have recently been, bounded by spin. The default (0, 0) always sleeps
+	straight away, which is best when threads outnumber cores.
+*/
+QUEUE_API void
+queue_set_spin (queue *q, unsigned spin, unsigned yield);
+
 QUEUE_API unsigned
 queue_begin_put (queue *q);
 
@@ -33,6 +165,133 @@ queue_begin_get (queue *q);
 QUEUE_API void
 queue_commit_get (queue *q);
 
+/*
+	Batched claims. queue_begin_put_n claims a contiguous run of up to n free slots,
+	starting at the returned index, and stores the run length in *count. The run stops
+	at the end of the slot array, so a caller wanting more goes around again after
+	committing. It waits only until at least one slot is free. queue_commit_put_n
+	publishes the first count slots of the run (count may be less than claimed).
+	The _get_n functions are the same for queued items. Like queue_begin_put, the
+	lock is held from begin to commit.
+*/
+QUEUE_API unsigned
+queue_begin_put_n (queue *q, unsigned n, unsigned *count);
+
+QUEUE_API void
+queue_commit_put_n (queue *q, unsigned count);
+
+QUEUE_API unsigned
+queue_begin_get_n (queue *q, unsigned n, unsigned *count);
+
+QUEUE_API void
+queue_commit_get_n (queue *q, unsigned count);
+
+/*
+	Out-of-lock slot ownership. queue_claim_put and queue_claim_get hold the lock only
+	long enough to claim a slot, so any number of producers and consumers can be
+	working on their own slots at the same time. Hand the slot back with
+	queue_complete_put or queue_complete_get. Completions can come in any order;
+	slots are retired in ring order, so consumers only see an item once every earlier
+	item is complete too, and a slot is only reused once it and every earlier slot
+	has been consumed. Can be mixed with the begin/commit calls.
+*/
+QUEUE_API unsigned
+queue_claim_put (queue *q);
+
+QUEUE_API void
+queue_complete_put (queue *q, unsigned slot);
+
+QUEUE_API unsigned
+queue_claim_get (queue *q);
+
+QUEUE_API void
+queue_complete_get (queue *q, unsigned slot);
+
+/*
+	Lock-free variants, with the same begin/commit slot-index protocol: begin returns
+	the index of a slot in the caller's array, the caller fills (or reads) that slot,
+	then commits it. No lock is held while the caller works on its slot.
+
+	queue_spsc is for exactly one producer thread and one consumer thread. Each side
+	keeps a cached copy of the other side's index, so it only touches the other side's
+	cache line when the queue looks full (or empty). Holds sz-1 items, like queue.
+
+	queue_mpmc is for any number of producers and consumers (Dmitry Vyukov's bounded
+	MPMC queue): every slot carries a sequence number that says whether it is ready to
+	be written or read in the current lap, and threads claim slots with one CAS on the
+	shared write or read position. Holds sz items. Since several slots can be in use
+	at once, commits take the slot index that begin returned.
+
+	begin blocks by spinning, then yielding, then sleeping briefly (see
+	QUEUE_BACKOFF_SPIN and QUEUE_BACKOFF_YIELD); try_begin returns 0 instead of blocking.
+*/
+typedef struct {
+
+	unsigned                     sz;
+
+	QUEUE_LINE _Atomic unsigned  w;
+	unsigned                     rcache;
+
+	QUEUE_LINE _Atomic unsigned  r;
+	unsigned                     wcache;
+
+} queue_spsc;
+
+QUEUE_API void
+queue_spsc_init (queue_spsc *q, unsigned sz);
+
+QUEUE_API unsigned
+queue_spsc_begin_put (queue_spsc *q);
+
+QUEUE_API int
+queue_spsc_try_begin_put (queue_spsc *q, unsigned *slot);
+
+QUEUE_API void
+queue_spsc_commit_put (queue_spsc *q);
+
+QUEUE_API unsigned
+queue_spsc_begin_get (queue_spsc *q);
+
+QUEUE_API int
+queue_spsc_try_begin_get (queue_spsc *q, unsigned *slot);
+
+QUEUE_API void
+queue_spsc_commit_get (queue_spsc *q);
+
+typedef struct {
+
+	_Atomic size_t            *seq;
+	unsigned                   sz;
+
+	QUEUE_LINE _Atomic size_t  w;
+	QUEUE_LINE _Atomic size_t  r;
+
+} queue_mpmc;
+
+QUEUE_API void
+queue_mpmc_init (queue_mpmc *q, unsigned sz);
+
+QUEUE_API void
+queue_mpmc_destroy (queue_mpmc *q);
+
+QUEUE_API unsigned
+queue_mpmc_begin_put (queue_mpmc *q);
+
+QUEUE_API int
+queue_mpmc_try_begin_put (queue_mpmc *q, unsigned *slot);
+
+QUEUE_API void
+queue_mpmc_commit_put (queue_mpmc *q, unsigned slot);
+
+QUEUE_API unsigned
+queue_mpmc_begin_get (queue_mpmc *q);
+
+QUEUE_API int
+queue_mpmc_try_begin_get (queue_mpmc *q, unsigned *slot);
+
+QUEUE_API void
+queue_mpmc_commit_get (queue_mpmc *q, unsigned slot);
+
 #endif
 
 #if defined(QUEUE_SELFTEST) && !defined(QUEUE_IMPLEMENTATION) 
@@ -42,10 +301,13 @@ queue_commit_get (queue *q);
 #ifdef QUEUE_IMPLEMENTATION
 
 #include "die.h"
+#include "nodemem.h"
 
 QUEUE_API void
-queue_init (queue *q, unsigned short sz) {
+queue_init (queue *q, unsigned sz) {
 	*q = (queue) {.sz = sz};
+	q->done = calloc(sz, 1);
+	if (!q->done) die("queue_init: calloc");
 	if (thrd_success != mtx_init(&q->m, mtx_plain )) die("queue_init: mtx_init");
 	if (thrd_success != cnd_init(&q->c)) die("queue_init: cnd_init");
 }
@@ -54,72 +316,608 @@ QUEUE_API void
 queue_destroy (queue *q) {
 	mtx_destroy(&q->m);
 	cnd_destroy(&q->c);
+	free(q->done);
 	*q = (queue) {};
 }
 
+QUEUE_API void *
+queue_alloc_slots (unsigned sz, size_t itemsize) {
+	const size_t line = QUEUE_CACHELINE ? QUEUE_CACHELINE : alignof(max_align_t);
+	const size_t bytes = ((size_t)sz * itemsize + line - 1) / line * line;
+	void *p = aligned_alloc(line, bytes ? bytes : line);
+	if (!p) die("queue_alloc_slots: aligned_alloc");
+	return p;
+}
+
+#if NODEMEM_AVAILABLE
+
+#define Q_MAXCPUS 4096
+
+QUEUE_API void *
+queue_alloc_slots_node (unsigned sz, size_t itemsize, int node) {
+	if (node < QUEUE_NODE_LOCAL || node >= NODEMEM_MAXNODES) die("queue_alloc_slots_node: bad node");
+	void *p = nodemem_map((size_t)sz * itemsize, node);
+	if (!p) die("queue_alloc_slots_node: mmap/mbind");
+	return p;
+}
+
+QUEUE_API void
+queue_free_slots_node (void *slots, unsigned sz, size_t itemsize) {
+	nodemem_unmap(slots, (size_t)sz * itemsize);
+}
+
+/*
+	Both pinning helpers go through the raw syscall with a plain bit mask, so that
+	they don't depend on _GNU_SOURCE and cpu_set_t.
+*/
+static int
+q_setaffinity (const unsigned long *mask, size_t bytes) {
+	return syscall(SYS_sched_setaffinity, 0, bytes, mask) ? -1 : 0;
+}
+
+QUEUE_API int
+queue_pin_cpu (int cpu) {
+	unsigned long mask[Q_MAXCPUS / (8 * sizeof(long))] = {0};
+	if (cpu < 0 || cpu >= Q_MAXCPUS) return -1;
+	mask[cpu / (8 * sizeof(long))] = 1ul << cpu % (8 * sizeof(long));
+	return q_setaffinity(mask, sizeof(mask));
+}
+
+/*
+	Node n's CPUs are listed in /sys as ranges, e.g. "0-7,16-23".
+*/
+QUEUE_API int
+queue_pin_node (int node) {
+	char path[64], list[4096];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	FILE *f = fopen(path, "r");
+	if (!f) return -1;
+	char *ok = fgets(list, sizeof(list), f);
+	fclose(f);
+	if (!ok) return -1;
+
+	unsigned long mask[Q_MAXCPUS / (8 * sizeof(long))] = {0};
+	int any = 0;
+	for (char *s = list; *s && *s != '\n'; ) {
+		char *end;
+		long lo = strtol(s, &end, 10), hi = lo;
+		if (end == s) return -1;
+		if (*end == '-') hi = strtol(end + 1, &end, 10);
+		for (long c = lo; c <= hi && c < Q_MAXCPUS; c++, any = 1)
+			mask[c / (8 * sizeof(long))] |= 1ul << c % (8 * sizeof(long));
+		s = *end == ',' ? end + 1 : end;
+	}
+	return any ? q_setaffinity(mask, sizeof(mask)) : -1;
+}
+
+QUEUE_API int
+queue_current_node (void) {
+	unsigned cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, 0)) return -1;
+	return node;
+}
+
+QUEUE_API int
+queue_node_count (void) {
+	char list[4096];
+	FILE *f = fopen("/sys/devices/system/node/online", "r");
+	if (!f) return 1;
+	char *ok = fgets(list, sizeof(list), f);
+	fclose(f);
+	if (!ok) return 1;
+
+	int n = 1;
+	for (char *s = list; *s; ) {
+		char *end;
+		long x = strtol(s, &end, 10);
+		if (end == s) { s++; continue; }
+		if (x + 1 > n) n = x + 1;
+		s = end;
+	}
+	return n;
+}
+
+#else
+
+QUEUE_API void *
+queue_alloc_slots_node (unsigned sz, size_t itemsize, int node) {
+	(void)node;
+	return queue_alloc_slots(sz, itemsize);
+}
+
+QUEUE_API void
+queue_free_slots_node (void *slots, unsigned sz, size_t itemsize) {
+	(void)sz; (void)itemsize;
+	free(slots);
+}
+
+QUEUE_API int queue_pin_node (int node) { (void)node; return -1; }
+QUEUE_API int queue_pin_cpu (int cpu) { (void)cpu; return -1; }
+QUEUE_API int queue_current_node (void) { return -1; }
+QUEUE_API int queue_node_count (void) { return 1; }
+
+#endif
+
 static inline int 
 q_full (queue *q) {
-	return (q->w + 1) % q->sz == q->r;
+	return (q->pw + 1) % q->sz == q->r;
 }
 
 static inline int
 q_empty (queue *q) {
-	return q->r == q->w;
+	return q->pr == q->w;
+}
+
+/*
+	Number of slots going around the ring from a to b.
+*/
+static inline unsigned
+q_dist (queue *q, unsigned a, unsigned b) {
+	return b >= a ? b - a : q->sz - (a - b);
+}
+
+static inline void
+q_pause (void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__ ("yield");
+#endif
+}
+
+QUEUE_API void
+queue_set_spin (queue *q, unsigned spin, unsigned yield) {
+	q->spin  = spin;
+	q->yield = yield;
+	q->spinhint = spin / 2;
+}
+
+/*
+	Spin, then yield, while blocked(q) holds, without taking the lock.
+	spinhint tracks how many spins recent waits needed: it moves toward the spin
+	count that succeeded, grows when we only just missed (the yield phase
+	succeeded), and shrinks when we gave up and had to sleep.
+*/
+static void
+q_spin (queue *q, int (*blocked)(queue *)) {
+
+	if ((!q->spin && !q->yield) || !blocked(q)) return;
+
+	const unsigned hint = atomic_load_explicit(&q->spinhint, memory_order_relaxed);
+	const unsigned limit = hint * 2 + 64 < q->spin ? hint * 2 + 64 : q->spin;
+
+	for (unsigned i = 0; i < limit; i++) {
+		q_pause();
+		if (!blocked(q)) {
+			atomic_store_explicit(&q->spinhint, hint + ((int)i - (int)hint) / 8, memory_order_relaxed);
+			return;
+		}
+	}
+
+	for (unsigned i = 0; i < q->yield; i++) {
+		thrd_yield();
+		if (!blocked(q)) {
+			atomic_store_explicit(&q->spinhint, hint + ((int)(2 * limit) - (int)hint) / 8, memory_order_relaxed);
+			return;
+		}
+	}
+
+	atomic_store_explicit(&q->spinhint, hint - hint / 4, memory_order_relaxed);
+}
+
+/*
+	Marks count claimed slots starting at slot as finished, then advances *retired
+	(w for puts, r for gets) over every finished slot at its front. Returns whether
+	*retired moved. When nothing earlier is outstanding, that is just an add.
+*/
+static int
+q_retire (queue *q, _Atomic unsigned *retired, unsigned claimed, unsigned slot, unsigned count) {
+
+	if (*retired == slot && q_dist(q, slot, claimed) == count) {
+		*retired = claimed;
+		return count > 0;
+	}
+
+	for (unsigned k = 0; k < count; k++)
+		q->done[(slot + k) % q->sz] = 1;
+
+	unsigned x = *retired;
+	while (x != claimed && q->done[x]) {
+		q->done[x] = 0;
+		x = (x + 1) % q->sz;
+	}
+	int moved = x != *retired;
+	*retired = x;
+	return moved;
+}
+
+#ifdef QUEUE_STATS
+/*
+	Monotonic where POSIX is visible, so a clock step can't turn a wait negative;
+	a strict -std=c11 build only has timespec_get.
+*/
+static unsigned long long
+q_ns (void) {
+	struct timespec t;
+#ifdef CLOCK_MONOTONIC
+	clock_gettime(CLOCK_MONOTONIC, &t);
+#else
+	timespec_get(&t, TIME_UTC);
+#endif
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+/*
+	Counts count newly committed slots, with depth sampled after a put.
+*/
+static void
+q_stat_commit (queue *q, int put, unsigned count) {
+	if (!put) {
+		q->stats.dequeued += count;
+		return;
+	}
+	q->stats.enqueued += count;
+	const unsigned depth = q_dist(q, q->r, q->pw);
+	if (depth > q->stats.max_depth) q->stats.max_depth = depth;
+	unsigned k = 0;
+	for (unsigned d = depth; d; d >>= 1) k++;
+	q->stats.depth_hist[k < QUEUE_DEPTH_BUCKETS ? k : QUEUE_DEPTH_BUCKETS - 1]++;
+}
+#define Q_STAT(x) (x)
+#else
+#define Q_STAT(x) ((void)0)
+#endif
+
+/*
+	mtx_lock, plus lock statistics if enabled: an uncontended acquisition then
+	costs one trylock and one clock read.
+*/
+static void
+q_acquire (queue *q, const char *who) {
+#ifdef QUEUE_STATS
+	const int rc = mtx_trylock(&q->m);
+	if (rc == thrd_success) {
+		q->locked_at = q_ns();
+		q->stats.lock_acquired++;
+		return;
+	}
+	if (rc != thrd_busy) die("%s: mtx_trylock", who);
+
+	const unsigned long long t = q_ns();
+	if (thrd_success != mtx_lock(&q->m)) die("%s: mtx_lock", who);
+	q->locked_at = q_ns();
+	q->stats.lock_acquired++;
+	q->stats.lock_contended++;
+	q->stats.lock_wait_ns += q->locked_at - t;
+#else
+	if (thrd_success != mtx_lock(&q->m)) die("%s: mtx_lock", who);
+#endif
+}
+
+static void
+q_lock (queue *q, int (*blocked)(queue *), const char *who) {
+	q_spin(q, blocked);
+	q_acquire(q, who);
+	while (blocked(q)) {
+#ifdef QUEUE_STATS
+		const int put = blocked == q_full;
+		const unsigned long long t = q_ns();
+		q->stats.lock_hold_ns += t - q->locked_at;
+		*(put ? &q->stats.put_waits : &q->stats.get_waits) += 1;
+		if (thrd_success != cnd_wait(&q->c, &q->m)) die("%s: cnd_wait", who);
+		q->locked_at = q_ns();
+		*(put ? &q->stats.put_wait_ns : &q->stats.get_wait_ns) += q->locked_at - t;
+		if (blocked(q)) q->stats.spurious++;
+#else
+		if (thrd_success != cnd_wait(&q->c, &q->m)) die("%s: cnd_wait", who);
+#endif
+	}
+}
+
+static void
+q_unlock (queue *q, int wakethds, const char *who) {
+	Q_STAT(q->stats.lock_hold_ns += q_ns() - q->locked_at);
+	if (thrd_success != mtx_unlock(&q->m)) die("%s: mtx_unlock", who);
+	if (wakethds) {
+		if (thrd_success != cnd_broadcast(&q->c)) die("%s: cnd_broadcast", who);
+	}
 }
 
 QUEUE_API unsigned
-queue_begin_put (queue *q)
+queue_begin_put_n (queue *q, unsigned n, unsigned *count)
 {
-	if (thrd_success != mtx_lock(&q->m)) die("queue_begin_put: mtx_lock");
+	q_lock(q, q_full, "queue_begin_put");
 
-	while (q_full(q)) {
-		if (thrd_success != cnd_wait(&q->c, &q->m)) die("queue_begin_put: cnd_wait");
-	}
+	const unsigned w = q->pw;
+	unsigned c = q->sz - 1 - q_dist(q, q->r, w);
+	if (c > q->sz - w) c = q->sz - w;
+	if (c > n) c = n;
+	*count = c;
+	return w;
+}
 
-	return q->w;
+QUEUE_API void
+queue_commit_put_n (queue *q, unsigned count) 
+{
+	const int wasempty = q_empty(q);
+	const unsigned slot = q->pw;
+
+	q->pw = (slot + count) % q->sz;
+	const int moved = q_retire(q, &q->w, q->pw, slot, count);
+	Q_STAT(q_stat_commit(q, 1, count));
+
+	q_unlock(q, wasempty && moved, "queue_commit_put");
+}
+
+QUEUE_API unsigned
+queue_begin_get_n (queue *q, unsigned n, unsigned *count) 
+{
+	q_lock(q, q_empty, "queue_begin_get");
+
+	const unsigned r = q->pr;
+	unsigned c = q_dist(q, r, q->w);
+	if (c > q->sz - r) c = q->sz - r;
+	if (c > n) c = n;
+	*count = c;
+	return r;
 }
 
 QUEUE_API void
-queue_commit_put (queue *q) 
+queue_commit_get_n (queue *q, unsigned count)
 {
+	const int wasfull = q_full(q);
+	const unsigned slot = q->pr;
+
+	q->pr = (slot + count) % q->sz;
+	const int moved = q_retire(q, &q->r, q->pr, slot, count);
+	Q_STAT(q_stat_commit(q, 0, count));
 
-	int wakethds = q_empty(q);
+	q_unlock(q, wasfull && moved, "queue_commit_get");
+}
 
-	q->w = (q->w + 1) % q->sz;
+QUEUE_API unsigned
+queue_claim_put (queue *q)
+{
+	q_lock(q, q_full, "queue_claim_put");
+	const unsigned slot = q->pw;
+	q->pw = (slot + 1) % q->sz;
+	q_unlock(q, 0, "queue_claim_put");
+	return slot;
+}
 
-	if (thrd_success != mtx_unlock(&q->m)) die("queue_commit_put: mtx_unlock");
-	
-	if (wakethds) {
-		if(thrd_success != cnd_broadcast(&q->c)) die("queue_commit_put: cnd_broadcast");
-	}
+QUEUE_API void
+queue_complete_put (queue *q, unsigned slot)
+{
+	q_acquire(q, "queue_complete_put");
+	const int wasempty = q_empty(q);
+	const int moved = q_retire(q, &q->w, q->pw, slot, 1);
+	Q_STAT(q_stat_commit(q, 1, 1));
+	q_unlock(q, wasempty && moved, "queue_complete_put");
 }
 
 QUEUE_API unsigned
-queue_begin_get (queue *q) 
+queue_claim_get (queue *q)
 {
-	if (thrd_success != mtx_lock(&q->m)) die("queue_begin_get: mtx_lock");
+	q_lock(q, q_empty, "queue_claim_get");
+	const unsigned slot = q->pr;
+	q->pr = (slot + 1) % q->sz;
+	q_unlock(q, 0, "queue_claim_get");
+	return slot;
+}
 
-	while (q_empty(q)) {
-		if (thrd_success != cnd_wait(&q->c, &q->m)) die("queue_begin_get: cnd_wait");
-	}
+QUEUE_API void
+queue_complete_get (queue *q, unsigned slot)
+{
+	q_acquire(q, "queue_complete_get");
+	const int wasfull = q_full(q);
+	const int moved = q_retire(q, &q->r, q->pr, slot, 1);
+	Q_STAT(q_stat_commit(q, 0, 1));
+	q_unlock(q, wasfull && moved, "queue_complete_get");
+}
 
-	return q->r;
+QUEUE_API int
+queue_stats (queue *q, struct queue_stats *out, int reset) {
+	q_acquire(q, "queue_stats");
+#ifdef QUEUE_STATS
+	*out = q->stats;
+#else
+	*out = (struct queue_stats) {0};
+#endif
+	out->depth = q_dist(q, q->r, q->pw);
+#ifdef QUEUE_STATS
+	if (reset) q->stats = (struct queue_stats) {.max_depth = out->depth};
+#else
+	(void)reset;
+#endif
+	q_unlock(q, 0, "queue_stats");
+#ifdef QUEUE_STATS
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+QUEUE_API unsigned
+queue_begin_put (queue *q)
+{
+	unsigned count;
+	return queue_begin_put_n(q, 1, &count);
+}
+
+QUEUE_API void
+queue_commit_put (queue *q) 
+{
+	queue_commit_put_n(q, 1);
+}
+
+QUEUE_API unsigned
+queue_begin_get (queue *q) 
+{
+	unsigned count;
+	return queue_begin_get_n(q, 1, &count);
 }
 
 QUEUE_API void
 queue_commit_get (queue *q)
 {
-	int wakethds = q_full(q);
+	queue_commit_get_n(q, 1);
+}
 
-	q->r = (q->r + 1) % q->sz;
+#ifndef QUEUE_BACKOFF_SPIN
+#define QUEUE_BACKOFF_SPIN 1024
+#endif
 
-	if (thrd_success != mtx_unlock(&q->m)) die("queue_commit_get: mtx_unlock");
-	
-	if (wakethds) {
-		if(thrd_success != cnd_broadcast(&q->c)) die("queue_commit_get: cnd_broadcast");
+#ifndef QUEUE_BACKOFF_YIELD
+#define QUEUE_BACKOFF_YIELD 64
+#endif
+
+/*
+	One step of waiting in the lock-free queues: pause, then yield, then sleep 50us.
+*/
+static void
+q_backoff (unsigned *n) {
+	if (*n < QUEUE_BACKOFF_SPIN) {
+		q_pause();
+	} else if (*n < QUEUE_BACKOFF_SPIN + QUEUE_BACKOFF_YIELD) {
+		thrd_yield();
+	} else {
+		thrd_sleep(&(struct timespec){.tv_nsec = 50000}, 0);
+		return;
+	}
+	(*n)++;
+}
+
+QUEUE_API void
+queue_spsc_init (queue_spsc *q, unsigned sz) {
+	if (sz < 2) die("queue_spsc_init: sz must be at least 2");
+	*q = (queue_spsc) {.sz = sz};
+}
+
+QUEUE_API int
+queue_spsc_try_begin_put (queue_spsc *q, unsigned *slot) {
+	const unsigned w = atomic_load_explicit(&q->w, memory_order_relaxed);
+	const unsigned next = w + 1 == q->sz ? 0 : w + 1;
+	if (next == q->rcache) {
+		q->rcache = atomic_load_explicit(&q->r, memory_order_acquire);
+		if (next == q->rcache) return 0;
+	}
+	*slot = w;
+	return 1;
+}
+
+QUEUE_API unsigned
+queue_spsc_begin_put (queue_spsc *q) {
+	unsigned slot, n = 0;
+	while (!queue_spsc_try_begin_put(q, &slot)) q_backoff(&n);
+	return slot;
+}
+
+QUEUE_API void
+queue_spsc_commit_put (queue_spsc *q) {
+	const unsigned w = atomic_load_explicit(&q->w, memory_order_relaxed);
+	atomic_store_explicit(&q->w, w + 1 == q->sz ? 0 : w + 1, memory_order_release);
+}
+
+QUEUE_API int
+queue_spsc_try_begin_get (queue_spsc *q, unsigned *slot) {
+	const unsigned r = atomic_load_explicit(&q->r, memory_order_relaxed);
+	if (r == q->wcache) {
+		q->wcache = atomic_load_explicit(&q->w, memory_order_acquire);
+		if (r == q->wcache) return 0;
+	}
+	*slot = r;
+	return 1;
+}
+
+QUEUE_API unsigned
+queue_spsc_begin_get (queue_spsc *q) {
+	unsigned slot, n = 0;
+	while (!queue_spsc_try_begin_get(q, &slot)) q_backoff(&n);
+	return slot;
+}
+
+QUEUE_API void
+queue_spsc_commit_get (queue_spsc *q) {
+	const unsigned r = atomic_load_explicit(&q->r, memory_order_relaxed);
+	atomic_store_explicit(&q->r, r + 1 == q->sz ? 0 : r + 1, memory_order_release);
+}
+
+/*
+	Slot i's sequence number starts at i. A producer at position pos may claim slot
+	pos % sz when seq == pos, and sets seq = pos + 1 on commit. A consumer at position
+	pos may claim the slot when seq == pos + 1, and sets seq = pos + sz on commit,
+	which is what the producer one lap later is waiting for.
+*/
+QUEUE_API void
+queue_mpmc_init (queue_mpmc *q, unsigned sz) {
+	if (sz < 1) die("queue_mpmc_init: sz must be at least 1");
+	*q = (queue_mpmc) {.sz = sz};
+	q->seq = queue_alloc_slots(sz, sizeof(q->seq[0]));
+	for (unsigned i = 0; i < sz; i++) atomic_init(&q->seq[i], i);
+}
+
+QUEUE_API void
+queue_mpmc_destroy (queue_mpmc *q) {
+	free(q->seq);
+	*q = (queue_mpmc) {0};
+}
+
+static int
+q_mpmc_claim (queue_mpmc *q, _Atomic size_t *pos_, size_t ready, unsigned *slot) {
+	size_t pos = atomic_load_explicit(pos_, memory_order_relaxed);
+	for (;;) {
+		const unsigned i = pos % q->sz;
+		const size_t seq = atomic_load_explicit(&q->seq[i], memory_order_acquire);
+		const ptrdiff_t dif = (ptrdiff_t)(seq - (pos + ready));
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(pos_, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				*slot = i;
+				return 1;
+			}
+		} else if (dif < 0) {
+			return 0;
+		} else {
+			pos = atomic_load_explicit(pos_, memory_order_relaxed);
+		}
 	}
 }
 
+QUEUE_API int
+queue_mpmc_try_begin_put (queue_mpmc *q, unsigned *slot) {
+	return q_mpmc_claim(q, &q->w, 0, slot);
+}
+
+QUEUE_API unsigned
+queue_mpmc_begin_put (queue_mpmc *q) {
+	unsigned slot, n = 0;
+	while (!queue_mpmc_try_begin_put(q, &slot)) q_backoff(&n);
+	return slot;
+}
+
+QUEUE_API void
+queue_mpmc_commit_put (queue_mpmc *q, unsigned slot) {
+	const size_t seq = atomic_load_explicit(&q->seq[slot], memory_order_relaxed);
+	atomic_store_explicit(&q->seq[slot], seq + 1, memory_order_release);
+}
+
+QUEUE_API int
+queue_mpmc_try_begin_get (queue_mpmc *q, unsigned *slot) {
+	return q_mpmc_claim(q, &q->r, 1, slot);
+}
+
+QUEUE_API unsigned
+queue_mpmc_begin_get (queue_mpmc *q) {
+	unsigned slot, n = 0;
+	while (!queue_mpmc_try_begin_get(q, &slot)) q_backoff(&n);
+	return slot;
+}
+
+QUEUE_API void
+queue_mpmc_commit_get (queue_mpmc *q, unsigned slot) {
+	const size_t seq = atomic_load_explicit(&q->seq[slot], memory_order_relaxed);
+	atomic_store_explicit(&q->seq[slot], seq - 1 + q->sz, memory_order_release);
+}
+
 #endif
 
 #ifdef QUEUE_SELFTEST
@@ -147,10 +945,10 @@ int producer (void * nothing) {
 
 		float f = randu(&_r);
 
-		unsigned u = queue_begin_put(&q);
+		unsigned u = queue_claim_put(&q);
 		printf("Thread %lu generating %f at slot %u\n", tid, f, u);
 		entries[u] = f;
-		queue_commit_put(&q);
+		queue_complete_put(&q, u);
 		usleep(randu(&_r) % 1000000);
 
 	}
@@ -167,9 +965,9 @@ int consumer (void * nothing) {
 	while(1) {
 
 
-		unsigned u = queue_begin_get(&q);
+		unsigned u = queue_claim_get(&q);
 		printf("Thread %lu got %f at slot %u\n", tid, entries[u], u);
-		queue_commit_get(&q);
+		queue_complete_get(&q, u);
 		usleep(randu(&_r) % 1000000);
 
 	}
@@ -177,8 +975,193 @@ int consumer (void * nothing) {
 	return 0;
 }
 
+/*
+	Lock-free variants: check that every item arrives exactly once, and in order
+	per producer, before running the chatty demo below.
+*/
+#define LF_ITEMS 200000
+#define LF_THREADS 4
+
+queue_spsc spsc;
+queue_mpmc mpmc;
+long lfslots[64];
+_Atomic long lfsum;
+
+int spsc_producer (void * nothing) {
+	(void)nothing;
+	for (long i = 0; i < LF_ITEMS; i++) {
+		unsigned u = queue_spsc_begin_put(&spsc);
+		lfslots[u] = i;
+		queue_spsc_commit_put(&spsc);
+	}
+	return 0;
+}
+
+int mpmc_producer (void * arg) {
+	long id = *(long *)arg;
+	for (long i = 0; i < LF_ITEMS; i++) {
+		unsigned u = queue_mpmc_begin_put(&mpmc);
+		lfslots[u] = id * LF_ITEMS + i;
+		queue_mpmc_commit_put(&mpmc, u);
+	}
+	return 0;
+}
+
+int mpmc_consumer (void * nothing) {
+	(void)nothing;
+	long last[LF_THREADS];
+	for (int i = 0; i < LF_THREADS; i++) last[i] = -1;
+	for (long i = 0; i < LF_ITEMS; i++) {
+		unsigned u = queue_mpmc_begin_get(&mpmc);
+		long v = lfslots[u];
+		queue_mpmc_commit_get(&mpmc, u);
+		xassert(v % LF_ITEMS > last[v / LF_ITEMS]);
+		last[v / LF_ITEMS] = v % LF_ITEMS;
+		lfsum += v;
+	}
+	return 0;
+}
+
+/*
+	Batched claims on a queue bigger than the old 16-bit index limit.
+*/
+#define BATCH_SZ 70000
+#define BATCH_ITEMS 1000000
+
+queue bq;
+long bslots[BATCH_SZ];
+
+int batch_producer (void * nothing) {
+	(void)nothing;
+	long i = 0;
+	while (i < BATCH_ITEMS) {
+		unsigned want = 1 + i % 997, c;
+		if (want > BATCH_ITEMS - i) want = BATCH_ITEMS - i;
+		unsigned u = queue_begin_put_n(&bq, want, &c);
+		xassert(c >= 1 && c <= want && u + c <= BATCH_SZ);
+		for (unsigned k = 0; k < c; k++) bslots[u + k] = i++;
+		queue_commit_put_n(&bq, c);
+	}
+	return 0;
+}
+
+static void
+batch_selftest (void) {
+	queue_init(&bq, BATCH_SZ);
+	thrd_t t;
+	thrd_create(&t, batch_producer, 0);
+	long i = 0;
+	while (i < BATCH_ITEMS) {
+		unsigned c;
+		unsigned u = queue_begin_get_n(&bq, 500, &c);
+		xassert(c >= 1 && c <= 500 && u + c <= BATCH_SZ);
+		for (unsigned k = 0; k < c; k++) xassert(bslots[u + k] == i++);
+		queue_commit_get_n(&bq, c);
+	}
+	thrd_join(t, 0);
+
+	struct queue_stats st;
+	if (queue_stats(&bq, &st, 0)) {
+		xassert(st.enqueued == BATCH_ITEMS && st.dequeued == BATCH_ITEMS);
+		xassert(st.max_depth > 0 && st.max_depth < BATCH_SZ && st.lock_acquired > 0);
+	}
+	xassert(st.depth == 0);
+	queue_destroy(&bq);
+	printf("batched queue selftest passed\n");
+}
+
+/*
+	Out-of-lock claims with completions arriving out of order: every item is seen
+	exactly once, and a slot is never overwritten while its consumer holds it.
+*/
+#define CLAIM_ITEMS 50000
+#define CLAIM_THREADS 4
+
+queue cq;
+long cslots[16];
+_Atomic unsigned char cseen[CLAIM_THREADS * CLAIM_ITEMS];
+
+int claim_producer (void * arg) {
+	long id = *(long *)arg;
+	unsigned long r = id + 1;
+	for (long i = 0; i < CLAIM_ITEMS; i++) {
+		unsigned u = queue_claim_put(&cq);
+		cslots[u] = id * CLAIM_ITEMS + i;
+		if (randu(&r) % 4 == 0) thrd_yield();
+		queue_complete_put(&cq, u);
+	}
+	return 0;
+}
+
+int claim_consumer (void * arg) {
+	long id = *(long *)arg;
+	unsigned long r = id + 100;
+	for (long i = 0; i < CLAIM_ITEMS; i++) {
+		unsigned u = queue_claim_get(&cq);
+		long v = cslots[u];
+		if (randu(&r) % 4 == 0) thrd_yield();
+		xassert(cslots[u] == v);
+		xassert(0 == atomic_exchange(&cseen[v], 1));
+		queue_complete_get(&cq, u);
+	}
+	return 0;
+}
+
+static void
+claim_selftest (void) {
+	queue_init(&cq, 16);
+	thrd_t t[2 * CLAIM_THREADS];
+	long ids[CLAIM_THREADS];
+	for (int i = 0; i < CLAIM_THREADS; i++) {
+		ids[i] = i;
+		thrd_create(t + i, claim_producer, ids + i);
+		thrd_create(t + CLAIM_THREADS + i, claim_consumer, ids + i);
+	}
+	for (int i = 0; i < 2 * CLAIM_THREADS; i++) thrd_join(t[i], 0);
+	for (long i = 0; i < CLAIM_THREADS * CLAIM_ITEMS; i++) xassert(cseen[i]);
+	xassert(q_empty(&cq) && q_dist(&cq, cq.r, cq.pw) == 0);
+	queue_destroy(&cq);
+	printf("out-of-lock claim selftest passed\n");
+}
+
+static void
+lockfree_selftest (void) {
+
+	thrd_t t[2 * LF_THREADS];
+
+	queue_spsc_init(&spsc, 64);
+	thrd_create(t, spsc_producer, 0);
+	for (long i = 0; i < LF_ITEMS; i++) {
+		unsigned u = queue_spsc_begin_get(&spsc);
+		xassert(lfslots[u] == i);
+		queue_spsc_commit_get(&spsc);
+	}
+	thrd_join(t[0], 0);
+	unsigned u;
+	xassert(!queue_spsc_try_begin_get(&spsc, &u));
+
+	queue_mpmc_init(&mpmc, 64);
+	long ids[LF_THREADS];
+	for (int i = 0; i < LF_THREADS; i++) {
+		ids[i] = i;
+		thrd_create(t + i, mpmc_producer, ids + i);
+		thrd_create(t + LF_THREADS + i, mpmc_consumer, 0);
+	}
+	for (int i = 0; i < 2 * LF_THREADS; i++) thrd_join(t[i], 0);
+	const long n = (long)LF_THREADS * LF_ITEMS;
+	xassert(lfsum == n * (n - 1) / 2);
+	xassert(!queue_mpmc_try_begin_get(&mpmc, &u));
+	queue_mpmc_destroy(&mpmc);
+
+	printf("lock-free queue selftest passed\n");
+}
+
 int main (void) {
 
+	batch_selftest();
+	claim_selftest();
+	lockfree_selftest();
+
 	queue_init(&q, 10);
 
 	thrd_t ts[6];
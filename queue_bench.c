@@ -0,0 +1,491 @@
+/*
+	Benchmarks for queue.h and evqueue.h.
+
+	Build: cc -O2 -pthread queue_bench.c -o queue_bench
+	Usage: queue_bench wait|layout|numa
+
+	wait:   one producer sends timestamps to one consumer at several rates, and
+	        the consumer reports delivery latency percentiles, for pure blocking
+	        versus spin-then-block waiting (queue_set_spin / evqueue_set_spin).
+
+	layout: producers and consumers push items through each queue type flat out,
+	        reporting throughput and, where perf_event_open is allowed, cache
+	        misses per item. To see what the cache-line layout buys, compare
+	        against a build with -DQUEUE_CACHELINE=0 -DEVQUEUE_CACHELINE=0.
+
+	numa:   two threads pinned to nodes a and b bounce a message back and forth
+	        through a pair of queue_spsc and an evqueue whose memory is on node m,
+	        for every combination of nodes, and report round-trip latency.
+*/
+
+#define QUEUE_IMPLEMENTATION
+#include "queue.h"
+#define EVQUEUE_IMPLEMENTATION
+#include "evqueue.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static long long
+now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ll + t.tv_nsec;
+}
+
+static int
+cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+static void
+report(const char *what, const char *mode, long long gap_ns, long long *lat, int n)
+{
+	qsort(lat, n, sizeof(lat[0]), cmp_ll);
+	printf("%-8s %-6s %8.1f %10.2f %10.2f %10.2f\n", what, mode, gap_ns / 1e3,
+		lat[n / 2] / 1e3, lat[n * 9 / 10] / 1e3, lat[n * 99 / 100] / 1e3);
+}
+
+/*
+	Paced producer: send n timestamps, one every gap_ns nanoseconds.
+*/
+struct wait_run {
+	int        n;
+	long long  gap_ns;
+	long long *lat;
+
+	queue      q;
+	long long  slots[256];
+
+	void      *evq;
+};
+
+static void
+pace(long long *next, long long gap_ns)
+{
+	if (!gap_ns) return;
+	while (now_ns() < *next);
+	*next += gap_ns;
+}
+
+static void *
+queue_producer(void *arg)
+{
+	struct wait_run *r = arg;
+	long long next = now_ns();
+	for (int i = 0; i < r->n; i++) {
+		pace(&next, r->gap_ns);
+		unsigned u = queue_begin_put(&r->q);
+		r->slots[u] = now_ns();
+		queue_commit_put(&r->q);
+	}
+	return 0;
+}
+
+static void *
+evqueue_producer(void *arg)
+{
+	struct wait_run *r = arg;
+	long long next = now_ns();
+	for (int i = 0; i < r->n; i++) {
+		pace(&next, r->gap_ns);
+		long long t = now_ns();
+		int ty = 0;
+		evqueue_putevents(r->evq, 1, &t, &ty, -1);
+	}
+	return 0;
+}
+
+static void
+bench_wait(void)
+{
+	const long long gaps[] = {0, 1000, 10000, 100000};
+	const struct {const char *name; unsigned spin, yield;} modes[] = {
+		{"block", 0,     0},
+		{"spin",  20000, 16},
+	};
+
+	printf("%-8s %-6s %8s %10s %10s %10s\n", "queue", "mode", "gap_us", "p50_us", "p90_us", "p99_us");
+
+	for (size_t g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+		for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+
+			struct wait_run *r = aligned_alloc(alignof(struct wait_run), sizeof(*r));
+			memset(r, 0, sizeof(*r));
+			r->gap_ns = gaps[g];
+			r->n = gaps[g] ? (int)(200000000 / gaps[g]) : 20000;
+			if (r->n > 20000) r->n = 20000;
+			r->lat = malloc(r->n * sizeof(r->lat[0]));
+
+			/* queue.h */
+			queue_init(&r->q, 256);
+			queue_set_spin(&r->q, modes[m].spin, modes[m].yield);
+			pthread_t t;
+			pthread_create(&t, 0, queue_producer, r);
+			for (int i = 0; i < r->n; i++) {
+				unsigned u = queue_begin_get(&r->q);
+				r->lat[i] = now_ns() - r->slots[u];
+				queue_commit_get(&r->q);
+			}
+			pthread_join(t, 0);
+			queue_destroy(&r->q);
+			report("queue", modes[m].name, r->gap_ns, r->lat, r->n);
+
+			/* evqueue.h */
+			r->evq = evqueue(256, sizeof(long long));
+			evqueue_set_spin(r->evq, modes[m].spin, modes[m].yield);
+			pthread_create(&t, 0, evqueue_producer, r);
+			for (int i = 0; i < r->n; i++) {
+				long long sent;
+				int ty;
+				evqueue_getevents(r->evq, 1, &sent, &ty, 0, 0, -1);
+				r->lat[i] = now_ns() - sent;
+			}
+			pthread_join(t, 0);
+			evqueue_free(r->evq);
+			report("evqueue", modes[m].name, r->gap_ns, r->lat, r->n);
+
+			free(r->lat);
+			free(r);
+		}
+	}
+}
+
+/*
+	Hardware cache-miss counter for this process and the threads it creates from
+	now on. Returns -1 where perf events aren't available (not Linux, or
+	perf_event_paranoid / a container forbids them).
+*/
+static int
+misses_open(void)
+{
+#ifdef __linux__
+	struct perf_event_attr a = {
+		.type           = PERF_TYPE_HARDWARE,
+		.size           = sizeof(a),
+		.config         = PERF_COUNT_HW_CACHE_MISSES,
+		.disabled       = 1,
+		.inherit        = 1,
+		.exclude_kernel = 1,
+		.exclude_hv     = 1,
+	};
+	int fd = syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
+	if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+static long long
+misses_close(int fd)
+{
+	long long n = -1;
+#ifdef __linux__
+	if (fd < 0) return -1;
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fd, &n, sizeof(n)) != sizeof(n)) n = -1;
+	close(fd);
+#endif
+	return n;
+}
+
+#define LAYOUT_ITEMS   2000000
+#define LAYOUT_THREADS 2
+
+struct layout_run {
+	queue_spsc spsc;
+	queue_mpmc mpmc;
+	queue      q;
+	void      *evq;
+	long      *slots;
+	int        nthreads;
+};
+
+static void *
+spsc_producer(void *arg)
+{
+	struct layout_run *r = arg;
+	for (long i = 0; i < LAYOUT_ITEMS; i++) {
+		unsigned u = queue_spsc_begin_put(&r->spsc);
+		r->slots[u] = i;
+		queue_spsc_commit_put(&r->spsc);
+	}
+	return 0;
+}
+
+static void *
+spsc_consumer(void *arg)
+{
+	struct layout_run *r = arg;
+	for (long i = 0; i < LAYOUT_ITEMS; i++) {
+		unsigned u = queue_spsc_begin_get(&r->spsc);
+		if (r->slots[u] != i) abort();
+		queue_spsc_commit_get(&r->spsc);
+	}
+	return 0;
+}
+
+static void *
+mpmc_producer(void *arg)
+{
+	struct layout_run *r = arg;
+	for (long i = 0; i < LAYOUT_ITEMS / r->nthreads; i++) {
+		unsigned u = queue_mpmc_begin_put(&r->mpmc);
+		r->slots[u] = i;
+		queue_mpmc_commit_put(&r->mpmc, u);
+	}
+	return 0;
+}
+
+static void *
+mpmc_consumer(void *arg)
+{
+	struct layout_run *r = arg;
+	for (long i = 0; i < LAYOUT_ITEMS / r->nthreads; i++) {
+		unsigned u = queue_mpmc_begin_get(&r->mpmc);
+		(void)r->slots[u];
+		queue_mpmc_commit_get(&r->mpmc, u);
+	}
+	return 0;
+}
+
+static void *
+locked_producer(void *arg)
+{
+	struct layout_run *r = arg;
+	for (long i = 0; i < LAYOUT_ITEMS / r->nthreads; i++) {
+		unsigned u = queue_claim_put(&r->q);
+		r->slots[u] = i;
+		queue_complete_put(&r->q, u);
+	}
+	return 0;
+}
+
+static void *
+locked_consumer(void *arg)
+{
+	struct layout_run *r = arg;
+	for (long i = 0; i < LAYOUT_ITEMS / r->nthreads; i++) {
+		unsigned u = queue_claim_get(&r->q);
+		(void)r->slots[u];
+		queue_complete_get(&r->q, u);
+	}
+	return 0;
+}
+
+static void *
+evq_producer(void *arg)
+{
+	struct layout_run *r = arg;
+	long evs[64];
+	int types[64] = {0};
+	for (long i = 0; i < LAYOUT_ITEMS / r->nthreads; i += 64) {
+		for (int k = 0; k < 64; k++) evs[k] = i + k;
+		evqueue_putevents(r->evq, 64, evs, types, -1);
+	}
+	return 0;
+}
+
+static void *
+evq_consumer(void *arg)
+{
+	struct layout_run *r = arg;
+	long evs[64];
+	int types[64];
+	/* never take more than this consumer's share, or another one starves */
+	const long want = LAYOUT_ITEMS / r->nthreads / 64 * 64;
+	long got = 0;
+	while (got < want) {
+		const unsigned n = want - got < 64 ? (unsigned)(want - got) : 64;
+		got += evqueue_getevents(r->evq, n, evs, types, 0, 0, -1);
+	}
+	return 0;
+}
+
+static void
+layout_one(const char *name, struct layout_run *r, int nthreads,
+	void *(*producer)(void *), void *(*consumer)(void *))
+{
+	pthread_t t[2 * LAYOUT_THREADS];
+	r->nthreads = nthreads;
+
+	int fd = misses_open();
+	long long t0 = now_ns();
+	for (int i = 0; i < nthreads; i++) {
+		pthread_create(&t[2 * i], 0, producer, r);
+		pthread_create(&t[2 * i + 1], 0, consumer, r);
+	}
+	for (int i = 0; i < 2 * nthreads; i++) pthread_join(t[i], 0);
+	long long dt = now_ns() - t0;
+	long long misses = misses_close(fd);
+
+	long items = nthreads == 1 ? LAYOUT_ITEMS : LAYOUT_ITEMS / nthreads * nthreads;
+	printf("%-8s %7d %10.2f ", name, nthreads, items / (dt / 1e3));
+	if (misses < 0) printf("%14s\n", "n/a");
+	else printf("%14.3f\n", (double)misses / items);
+}
+
+static void
+bench_layout(void)
+{
+	printf("cache line padding: queue %d, evqueue %d\n", QUEUE_CACHELINE, EVQUEUE_CACHELINE);
+	printf("%-8s %7s %10s %14s\n", "queue", "threads", "Mitems/s", "misses/item");
+
+	struct layout_run *r = aligned_alloc(alignof(struct layout_run), sizeof(*r));
+	r->slots = queue_alloc_slots(1024, sizeof(long));
+
+	queue_spsc_init(&r->spsc, 1024);
+	layout_one("spsc", r, 1, spsc_producer, spsc_consumer);
+
+	queue_mpmc_init(&r->mpmc, 1024);
+	layout_one("mpmc", r, LAYOUT_THREADS, mpmc_producer, mpmc_consumer);
+	queue_mpmc_destroy(&r->mpmc);
+
+	queue_init(&r->q, 1024);
+	layout_one("queue", r, LAYOUT_THREADS, locked_producer, locked_consumer);
+	queue_destroy(&r->q);
+
+	r->evq = evqueue(1024, sizeof(long));
+	layout_one("evqueue", r, LAYOUT_THREADS, evq_producer, evq_consumer);
+	evqueue_free(r->evq);
+
+	free(r->slots);
+	free(r);
+}
+
+#define NUMA_ROUNDS 100000
+
+struct numa_run {
+	queue_spsc  ping, pong;
+	long       *ping_slots, *pong_slots;
+	void       *evq;
+	int         node;
+};
+
+static void *
+spsc_ponger(void *arg)
+{
+	struct numa_run *r = arg;
+	queue_pin_node(r->node);
+	for (long i = 0; i < NUMA_ROUNDS; i++) {
+		unsigned u = queue_spsc_begin_get(&r->ping);
+		long v = r->ping_slots[u];
+		queue_spsc_commit_get(&r->ping);
+		u = queue_spsc_begin_put(&r->pong);
+		r->pong_slots[u] = v;
+		queue_spsc_commit_put(&r->pong);
+	}
+	return 0;
+}
+
+enum { NUMA_PING = 1, NUMA_PONG = 2 };
+
+static void *
+evq_ponger(void *arg)
+{
+	struct numa_run *r = arg;
+	queue_pin_node(r->node);
+	int ping = NUMA_PING;
+	for (long i = 0; i < NUMA_ROUNDS / 10; i++) {
+		long v;
+		int ty;
+		evqueue_getevents(r->evq, 1, &v, &ty, 1, &ping, -1);
+		ty = NUMA_PONG;
+		evqueue_putevents(r->evq, 1, &v, &ty, -1);
+	}
+	return 0;
+}
+
+static void
+bench_numa(void)
+{
+	const int nodes = queue_node_count();
+	printf("%d node(s)\n", nodes);
+	printf("%-8s %4s %4s %4s %10s\n", "queue", "a", "b", "mem", "rtt_ns");
+
+	struct numa_run *r = aligned_alloc(alignof(struct numa_run), sizeof(*r));
+	memset(r, 0, sizeof(*r));
+	pthread_t t;
+
+	for (int a = 0; a < nodes; a++)
+	for (int b = 0; b < nodes; b++)
+	for (int m = 0; m < nodes; m++) {
+		/* skip nodes without CPUs */
+		if (queue_pin_node(b) || queue_pin_node(a)) continue;
+		r->node = b;
+
+		queue_spsc_init(&r->ping, 64);
+		queue_spsc_init(&r->pong, 64);
+		r->ping_slots = queue_alloc_slots_node(64, sizeof(long), m);
+		r->pong_slots = queue_alloc_slots_node(64, sizeof(long), m);
+		pthread_create(&t, 0, spsc_ponger, r);
+		long long t0 = now_ns();
+		for (long i = 0; i < NUMA_ROUNDS; i++) {
+			unsigned u = queue_spsc_begin_put(&r->ping);
+			r->ping_slots[u] = i;
+			queue_spsc_commit_put(&r->ping);
+			u = queue_spsc_begin_get(&r->pong);
+			if (r->pong_slots[u] != i) abort();
+			queue_spsc_commit_get(&r->pong);
+		}
+		long long dt = now_ns() - t0;
+		pthread_join(t, 0);
+		queue_free_slots_node(r->ping_slots, 64, sizeof(long));
+		queue_free_slots_node(r->pong_slots, 64, sizeof(long));
+		printf("%-8s %4d %4d %4d %10.1f\n", "spsc", a, b, m, (double)dt / NUMA_ROUNDS);
+
+		r->evq = evqueue_node(64, sizeof(long), 64, m);
+		pthread_create(&t, 0, evq_ponger, r);
+		int pong = NUMA_PONG;
+		t0 = now_ns();
+		for (long i = 0; i < NUMA_ROUNDS / 10; i++) {
+			long v = i;
+			int ty = NUMA_PING;
+			evqueue_putevents(r->evq, 1, &v, &ty, -1);
+			evqueue_getevents(r->evq, 1, &v, &ty, 1, &pong, -1);
+			if (v != i) abort();
+		}
+		dt = now_ns() - t0;
+		pthread_join(t, 0);
+		evqueue_free(r->evq);
+		printf("%-8s %4d %4d %4d %10.1f\n", "evqueue", a, b, m, (double)dt / (NUMA_ROUNDS / 10));
+	}
+
+	free(r);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc == 2 && !strcmp(argv[1], "wait")) {
+		bench_wait();
+		return 0;
+	}
+
+	if (argc == 2 && !strcmp(argv[1], "layout")) {
+		bench_layout();
+		return 0;
+	}
+
+	if (argc == 2 && !strcmp(argv[1], "numa")) {
+		bench_numa();
+		return 0;
+	}
+
+	fprintf(stderr, "usage: %s wait|layout|numa\n", argv[0]);
+	return 1;
+}
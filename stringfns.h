@@ -8,10 +8,15 @@
 
 #ifndef STRINGFNS_H
 #define STRINGFNS_H
+#include <stddef.h>
 #include <wchar.h>
 
 /*
 	Trim leading and trailing whitespace from (wide) character string, in-place.
+
+	Whitespace is the C locale's: space, \t, \n, \v, \f and \r (plus, for wide
+	strings, any other character iswspace accepts). Narrow strings are scanned 16 or
+	32 bytes at a time where SSE2 or AVX2 is enabled at compile time.
 */
 
 void
@@ -20,6 +25,19 @@ wstr_trim_inplace(wchar_t * str);
 void
 str_trim_inplace(char * str);
 
+/*
+	Non-destructive trim of the len characters at str, which need not be
+	NUL-terminated: returns a pointer to the first non-whitespace character
+	and stores the length of the trimmed text in *trimmed_len. Nothing is moved
+	or written.
+*/
+
+const char *
+str_trim_span(const char * str, size_t len, size_t * trimmed_len);
+
+const wchar_t *
+wstr_trim_span(const wchar_t * str, size_t len, size_t * trimmed_len);
+
 char *
 skipnl (char *t);
 
@@ -32,6 +50,98 @@ skipwhitespace(char *t);
 char * 
 strsepstr(char **string, const char *delim);
 
+/*
+	Splits a buffer of known length on a multi-byte delimiter, without relying on
+	or writing NUL terminators. The delimiter is measured once at init (it must be
+	non-empty and outlive the splitter), and each call resumes where the last
+	match ended, so iterating all fields is one pass over the buffer.
+
+	A buffer with n delimiters has n+1 fields: "a,,b," split on "," gives "a", "",
+	"b" and "". str_split_next returns 1 and sets *field and *flen for each field, then
+	0 once the buffer is exhausted.
+
+		str_splitter sp;
+		str_splitter_init(&sp, "\r\n", buf, len);
+		const char *f; size_t n;
+		while (str_split_next(&sp, &f, &n)) ...
+*/
+
+typedef struct {
+	const char *delim;
+	size_t dlen;
+	const char *cur;
+	size_t left;
+	int done;
+} str_splitter;
+
+void
+str_splitter_init(str_splitter * sp, const char * delim, const char * buf, size_t len);
+
+int
+str_split_next(str_splitter * sp, const char ** field, size_t * flen);
+
+/*
+	First occurrence of delim[0..dlen) in s[0..len), or NULL.
+*/
+
+const char *
+str_find(const char * s, size_t len, const char * delim, size_t dlen);
+
+/*
+	strview: a (ptr, len) slice that is never written through and need not be
+	NUL-terminated, e.g. a region of an mmap'd file. These mirror the char *
+	functions above but return narrowed views instead of editing the buffer.
+	Print one with printf("%" SV_FMT, SV_ARG(v)).
+*/
+
+typedef struct {
+	const char *ptr;
+	size_t len;
+} strview;
+
+#define SV_FMT ".*s"
+#define SV_ARG(v) (int)(v).len, (v).ptr
+
+strview
+sv_from(const char * ptr, size_t len);
+
+strview
+sv_cstr(const char * str);
+
+int
+sv_eq(strview a, strview b);
+
+strview
+sv_trim(strview v);
+
+strview
+sv_ltrim(strview v);
+
+strview
+sv_rtrim(strview v);
+
+strview
+sv_skipnl(strview v);
+
+strview
+sv_skipst(strview v);
+
+strview
+sv_skipwhitespace(strview v);
+
+/*
+	Like strsep: returns the text before the next delim in *v and advances *v past
+	it. When there is no delim left, returns all of *v and sets v->ptr to NULL, so
+
+		while (v.ptr) { strview field = sv_sep(&v, delim); ... }
+
+	visits every field, including empty ones. An empty delim matches nowhere, so
+	all of *v is one field.
+*/
+
+strview
+sv_sep(strview * v, strview delim);
+
 #endif
 
 #ifdef STRINGFNS_IMPLEMENTATION
@@ -41,20 +151,133 @@ strsepstr(char **string, const char *delim);
 #include <ctype.h>
 #include <stdio.h>
 
+/*
+	Whitespace classification without a locale lookup: \t..\r are 9..13.
+*/
+static inline int
+str_isws(unsigned char c)
+{
+	return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+static inline int
+wstr_isws(wchar_t c)
+{
+	return (unsigned long)c < 128 ? str_isws((unsigned char)c) : iswspace((wint_t)c);
+}
+
+/*
+	str_ws_mask(p) has bit i set if byte p[i] is whitespace, for STR_VEC bytes.
+	Bytes 9..13 are found by subtracting 9 and checking the result is at most 4
+	(min_epu8(x, 4) == x), since SSE2 has no unsigned byte compare.
+*/
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__AVX2__)
+#include <immintrin.h>
+#define STR_VEC 32
+#define STR_VEC_ALL 0xffffffffu
+
+static inline unsigned
+str_ws_mask(const char *p)
+{
+	const __m256i b   = _mm256_loadu_si256((const __m256i *)p);
+	const __m256i x   = _mm256_sub_epi8(b, _mm256_set1_epi8('\t'));
+	const __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(4)), x);
+	const __m256i sp  = _mm256_cmpeq_epi8(b, _mm256_set1_epi8(' '));
+	return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(ctl, sp));
+}
+
+static inline unsigned
+str_byte_mask(const char *p, char c)
+{
+	const __m256i b = _mm256_loadu_si256((const __m256i *)p);
+	return (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, _mm256_set1_epi8(c)));
+}
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
+#include <emmintrin.h>
+#define STR_VEC 16
+#define STR_VEC_ALL 0xffffu
+
+static inline unsigned
+str_ws_mask(const char *p)
+{
+	const __m128i b   = _mm_loadu_si128((const __m128i *)p);
+	const __m128i x   = _mm_sub_epi8(b, _mm_set1_epi8('\t'));
+	const __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(4)), x);
+	const __m128i sp  = _mm_cmpeq_epi8(b, _mm_set1_epi8(' '));
+	return (unsigned)_mm_movemask_epi8(_mm_or_si128(ctl, sp));
+}
+
+static inline unsigned
+str_byte_mask(const char *p, char c)
+{
+	const __m128i b = _mm_loadu_si128((const __m128i *)p);
+	return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(b, _mm_set1_epi8(c)));
+}
+#endif
+
+/*
+	Number of leading whitespace bytes in s[0..len).
+*/
+static size_t
+str_ws_prefix(const char *s, size_t len)
+{
+	size_t i = 0;
+#ifdef STR_VEC
+	for (; i + STR_VEC <= len; i += STR_VEC) {
+		const unsigned m = ~str_ws_mask(s + i) & STR_VEC_ALL;
+		if (m) return i + __builtin_ctz(m);
+	}
+#endif
+	while (i < len && str_isws(s[i])) i++;
+	return i;
+}
+
+/*
+	Length of s[0..len) without its trailing whitespace.
+*/
+static size_t
+str_ws_suffix(const char *s, size_t len)
+{
+	size_t n = len;
+#ifdef STR_VEC
+	for (; n >= STR_VEC; n -= STR_VEC) {
+		const unsigned m = ~str_ws_mask(s + n - STR_VEC) & STR_VEC_ALL;
+		if (m) return n - STR_VEC + 32 - __builtin_clz(m);
+	}
+#endif
+	while (n > 0 && str_isws(s[n-1])) n--;
+	return n;
+}
+
+const char *
+str_trim_span(const char * str, size_t len, size_t * trimmed_len)
+{
+	const size_t first = str_ws_prefix(str, len);
+	*trimmed_len = first == len ? 0 : str_ws_suffix(str, len) - first;
+	return str + first;
+}
+
+const wchar_t *
+wstr_trim_span(const wchar_t * str, size_t len, size_t * trimmed_len)
+{
+	size_t first = 0;
+	while(first < len && wstr_isws(str[first])) first++;
+	size_t end = len;
+	while(end > first && wstr_isws(str[end-1])) end--;
+	*trimmed_len = end - first;
+	return str + first;
+}
+
 void
 wstr_trim_inplace(wchar_t * str)
 {
 	/*
 		Trim leading and trailing whitespace from wide character string, in-place.
 	*/
-	const size_t len = wcslen(str);
-	if(len == 0) return;
-	size_t first = 0;
-	while(first < len && iswspace(str[first])) first++;
-	size_t last = len-1;
-	while(last > first && iswspace(str[last])) last--;
-	wmemmove(str,&str[first],last-first+1);
-	str[last-first+1] = 0;
+	size_t n;
+	const wchar_t *t = wstr_trim_span(str, wcslen(str), &n);
+	if(t != str) wmemmove(str, t, n);
+	str[n] = 0;
 }
 
 void
@@ -63,14 +286,10 @@ str_trim_inplace(char * str)
 	/*
 		Trim leading and trailing whitespace from string, in-place.
 	*/
-	const size_t len = strlen(str);
-	if(len == 0) return;
-	size_t first = 0;
-	while(first < len && isspace(str[first])) first++;
-	size_t last = len-1;
-	while(last > first && isspace(str[last])) last--;
-	memmove(str,&str[first],last-first+1);
-	str[last-first+1] = 0;
+	size_t n;
+	const char *t = str_trim_span(str, strlen(str), &n);
+	if(t != str) memmove(str, t, n);
+	str[n] = 0;
 }
 
 char *
@@ -122,35 +341,317 @@ strsepstr(char **string, const char *delim)
 	return retval;
 }
 
+const char *
+str_find(const char * s, size_t len, const char * delim, size_t dlen)
+{
+	/*
+		A position is only a candidate if both its first byte and the byte dlen-1
+		further on match the delimiter's first and last bytes. The vector loop
+		tests STR_VEC positions per pair of compares, which rejects almost all of
+		them before any memcmp. The tail (and targets without SIMD) skips from
+		one occurrence of the first byte to the next with memchr.
+	*/
+	if (dlen == 0) return s;
+	if (dlen > len) return 0;
+	if (dlen == 1) return memchr(s, delim[0], len);
+
+	const size_t last = len - dlen;
+	size_t i = 0;
+#ifdef STR_VEC
+	for (; i + STR_VEC <= last + 1; i += STR_VEC) {
+		unsigned m = str_byte_mask(s + i, delim[0]) & str_byte_mask(s + i + dlen - 1, delim[dlen-1]);
+		while (m) {
+			const char *p = s + i + __builtin_ctz(m);
+			if (dlen == 2 || !memcmp(p + 1, delim + 1, dlen - 2)) return p;
+			m &= m - 1;
+		}
+	}
+#endif
+	while (i <= last) {
+		const char *p = memchr(s + i, delim[0], last - i + 1);
+		if (!p) return 0;
+		if (!memcmp(p, delim, dlen)) return p;
+		i = (size_t)(p - s) + 1;
+	}
+	return 0;
+}
+
+void
+str_splitter_init(str_splitter * sp, const char * delim, const char * buf, size_t len)
+{
+	sp->delim = delim;
+	sp->dlen  = strlen(delim);
+	sp->cur   = buf;
+	sp->left  = len;
+	sp->done  = sp->dlen == 0;
+}
+
+int
+str_split_next(str_splitter * sp, const char ** field, size_t * flen)
+{
+	if (sp->done) return 0;
+	const char *x = str_find(sp->cur, sp->left, sp->delim, sp->dlen);
+	*field = sp->cur;
+	if (x) {
+		*flen = (size_t)(x - sp->cur);
+		sp->cur   = x + sp->dlen;
+		sp->left -= *flen + sp->dlen;
+	} else {
+		*flen = sp->left;
+		sp->cur  += sp->left;
+		sp->left  = 0;
+		sp->done  = 1;
+	}
+	return 1;
+}
+
+strview
+sv_from(const char * ptr, size_t len)
+{
+	return (strview){ptr, len};
+}
+
+strview
+sv_cstr(const char * str)
+{
+	return (strview){str, strlen(str)};
+}
+
+int
+sv_eq(strview a, strview b)
+{
+	return a.len == b.len && (a.len == 0 || !memcmp(a.ptr, b.ptr, a.len));
+}
+
+strview
+sv_trim(strview v)
+{
+	size_t n;
+	const char *p = str_trim_span(v.ptr, v.len, &n);
+	return (strview){p, n};
+}
+
+strview
+sv_ltrim(strview v)
+{
+	const size_t i = str_ws_prefix(v.ptr, v.len);
+	return (strview){v.ptr + i, v.len - i};
+}
+
+strview
+sv_rtrim(strview v)
+{
+	return (strview){v.ptr, str_ws_suffix(v.ptr, v.len)};
+}
+
+strview
+sv_skipnl(strview v)
+{
+	while (v.len && (*v.ptr == '\r' || *v.ptr == '\n')) v.ptr++, v.len--;
+	return v;
+}
+
+strview
+sv_skipst(strview v)
+{
+	while (v.len && (*v.ptr == '\r' || *v.ptr == ' ')) v.ptr++, v.len--;
+	return v;
+}
+
+strview
+sv_skipwhitespace(strview v)
+{
+	return sv_ltrim(v);
+}
+
+strview
+sv_sep(strview * v, strview delim)
+{
+	const strview field = *v;
+	const char *x = delim.len ? str_find(v->ptr, v->len, delim.ptr, delim.len) : 0;
+	if (!x) {
+		v->ptr = 0;
+		v->len = 0;
+		return field;
+	}
+	const size_t n = (size_t)(x - v->ptr);
+	v->ptr  = x + delim.len;
+	v->len -= n + delim.len;
+	return (strview){field.ptr, n};
+}
+
 
 #endif
 #ifdef STRINGFNS_SELF_TEST
 
+#include <assert.h>
+#include <locale.h>
+#include <stdlib.h>
+
+/*
+	Compare str_trim_span against a byte-at-a-time trim, on random strings long
+	enough to cross several vector blocks, starting at every alignment.
+*/
+static void
+trim_span_selftest(void)
+{
+	static const char alphabet[] = " \t\n\v\f\rx\x80\xff\x08\x0e!";
+	char buf[256];
+	srand(1);
+	for (int iter = 0; iter < 200000; iter++) {
+		const size_t off = rand() % 32;
+		const size_t len = rand() % (sizeof(buf) - off);
+		const int dense = rand() % 4;
+		for (size_t i = 0; i < len; i++)
+			buf[off + i] = dense ? alphabet[rand() % 6] : alphabet[rand() % (sizeof(alphabet) - 1)];
+		if (dense && len) buf[off + rand() % len] = 'x';
+
+		size_t first = 0, end = len;
+		while (first < len && isspace((unsigned char)buf[off + first])) first++;
+		while (end > first && isspace((unsigned char)buf[off + end - 1])) end--;
+
+		size_t n;
+		const char *t = str_trim_span(buf + off, len, &n);
+		assert(t == buf + off + first && n == end - first);
+	}
+	printf("str_trim_span matches the byte-at-a-time trim\n");
+}
+
+/*
+	Split random buffers over a small alphabet (so delimiters, and near misses,
+	are common) and check the fields against a naive search.
+*/
+static void
+splitter_selftest(void)
+{
+	static const char *delims[] = {"a", "ab", "aba", "\r\n", "abcab", "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"};
+	char buf[300];
+	srand(2);
+	for (int iter = 0; iter < 100000; iter++) {
+		const char *d = delims[rand() % (sizeof(delims) / sizeof(*delims))];
+		const size_t dlen = strlen(d);
+		const size_t len = rand() % sizeof(buf);
+		for (size_t i = 0; i < len; i++) buf[i] = "abc\r\n"[rand() % (rand() % 2 ? 2 : 5)];
+
+		str_splitter sp;
+		str_splitter_init(&sp, d, buf, len);
+		const char *f;
+		size_t n, pos = 0;
+		for (int more = 1; more; ) {
+			size_t end = pos;
+			while (end + dlen <= len && memcmp(buf + end, d, dlen)) end++;
+			more = end + dlen <= len;
+			if (!more) end = len;
+			assert(str_split_next(&sp, &f, &n));
+			assert(f == buf + pos && n == end - pos);
+			pos = end + dlen;
+		}
+		assert(!str_split_next(&sp, &f, &n));
+	}
+	printf("str_splitter matches a naive split\n");
+}
+
+/*
+	The views are taken over an exactly-sized heap copy with no terminator, so a
+	read past the end shows up under ASan.
+*/
+static void
+strview_selftest(void)
+{
+	static const char text[] = "\r\n  key = value ;; \t ;;x;;";
+	char *buf = malloc(sizeof(text) - 1);
+	memcpy(buf, text, sizeof(text) - 1);
+	strview v = sv_from(buf, sizeof(text) - 1);
+
+	assert(sv_eq(sv_skipnl(v), sv_from(buf + 2, v.len - 2)));
+	assert(sv_eq(sv_skipst(sv_skipnl(v)), sv_cstr("key = value ;; \t ;;x;;")));
+	assert(sv_eq(sv_skipwhitespace(v), sv_skipst(sv_skipnl(v))));
+	assert(sv_rtrim(v).len == v.len);
+
+	static const char *want[] = {"key = value", "", "x", ""};
+	strview rest = v;
+	size_t nf = 0;
+	while (rest.ptr) {
+		strview f = sv_trim(sv_sep(&rest, sv_cstr(";;")));
+		assert(nf < 4 && sv_eq(f, sv_cstr(want[nf])));
+		nf++;
+	}
+	assert(nf == 4);
+
+	strview kv = sv_cstr("key = value"), key = sv_trim(sv_sep(&kv, sv_cstr("=")));
+	assert(sv_eq(key, sv_cstr("key")) && sv_eq(sv_trim(kv), sv_cstr("value")));
+	rest = v;
+	assert(sv_eq(sv_sep(&rest, sv_from("", 0)), v) && !rest.ptr);
+	assert(sv_trim(sv_from(buf, 2)).len == 0);
+	printf("strview: '%" SV_FMT "' = '%" SV_FMT "'\n", SV_ARG(key), SV_ARG(sv_trim(kv)));
+	free(buf);
+}
+
+/*
+	Wide trims, in place and as spans. Non-ASCII whitespace depends on the locale,
+	so that case only runs where C.UTF-8 exists.
+*/
+static void
+wstr_trim_selftest(void)
+{
+	static const struct { const wchar_t *in, *want; } cases[] = {
+		{L"",             L""},
+		{L" \t\n\v\f\r ", L""},
+		{L"  \tx y",      L"x y"},
+		{L"x y \r\n",     L"x y"},
+		{L"\n x \n",      L"x"},
+		{L"x",            L"x"},
+		{L"\u00e9 \u00e9",  L"\u00e9 \u00e9"},
+	};
+	for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+		wchar_t buf[32];
+		wcscpy(buf, cases[i].in);
+		size_t n;
+		const wchar_t *t = wstr_trim_span(buf, wcslen(buf), &n);
+		assert(n == wcslen(cases[i].want) && !wmemcmp(t, cases[i].want, n));
+		wstr_trim_inplace(buf);
+		assert(!wcscmp(buf, cases[i].want));
+	}
+
+	if (setlocale(LC_CTYPE, "C.UTF-8")) {
+		wchar_t buf[] = L"\u3000\u2003 x\u00a0\u3000";
+		wstr_trim_inplace(buf);
+		assert(!wcscmp(buf, L"x\u00a0"));
+		setlocale(LC_CTYPE, "C");
+	}
+	printf("wstr_trim_span and wstr_trim_inplace pass\n");
+}
+
 int main(void)
 {
+	trim_span_selftest();
+	splitter_selftest();
+	strview_selftest();
+	wstr_trim_selftest();
+
 	{
 		wchar_t test[100] = L" Hello   \n\r  ";
-		wprintf(L"Before: '%ls'\n", test);
+		printf("Before: '%ls'\n", test);
 		wstr_trim_inplace(test);
-		wprintf(L"After:  '%ls'\n", test);
+		printf("After:  '%ls'\n", test);
 	}
 	{
 		wchar_t test[100] = L"Hello   \n\r  ";
-		wprintf(L"Before: '%ls'\n", test);
+		printf("Before: '%ls'\n", test);
 		wstr_trim_inplace(test);
-		wprintf(L"After:  '%ls'\n", test);
+		printf("After:  '%ls'\n", test);
 	}
 	{
 		wchar_t test[100] = L" Hello";
-		wprintf(L"Before: '%ls'\n", test);
+		printf("Before: '%ls'\n", test);
 		wstr_trim_inplace(test);
-		wprintf(L"After:  '%ls'\n", test);
+		printf("After:  '%ls'\n", test);
 	}
 	{
 		wchar_t test[100] = L"Hello";
-		wprintf(L"Before: '%ls'\n", test);
+		printf("Before: '%ls'\n", test);
 		wstr_trim_inplace(test);
-		wprintf(L"After:  '%ls'\n", test);
+		printf("After:  '%ls'\n", test);
 	}
 
 
@@ -0,0 +1,524 @@
+#ifndef TSV_H
+#define TSV_H
+
+/*
+	Reading TSV records, as escaped by tsvescape.h: fields are separated by tabs,
+	records end at a newline, and a backslash, tab, newline or CR inside a field
+	is written as \\, \t, \n or \r.
+
+	tsv_parse splits one record into fields in a single pass, 16 or 32 bytes at a
+	time with SSE2 or AVX2, without copying or unescaping anything: it records
+	where each field starts and whether it holds a backslash. tsv_field unescapes
+	a field only when you ask for it, and only if it has to.
+
+	tsv_writer goes the other way: it escapes fields straight into one large
+	buffer, separates them with tabs and newlines, and writes the buffer out with
+	a single write whenever it fills.
+
+	To use: define TSV_IMPLEMENTATION in one .c file before you include this header;
+	that file implements tsvescape.h as well. Define TSV_PARALLEL everywhere you
+	include this header to get tsv_parse_parallel; it needs pool.h and linereader.h
+	implemented somewhere.
+*/
+
+#ifndef TSV_API
+#define TSV_API
+#endif
+
+/*
+	Default size of a tsv_writer's buffer.
+*/
+#ifndef TSV_WRITER_BUFSIZE
+#define TSV_WRITER_BUFSIZE (1 << 20)
+#endif
+
+#include <stddef.h>
+#include "stringfns.h"
+
+/*
+	One parsed record. Field i is line.ptr[start[i] .. start[i+1]-1), so
+	start[nfields] is line.len + 1. The record points into the parsed buffer,
+	which must outlive it. A record is reused from one tsv_parse to the next.
+*/
+typedef struct {
+	strview        line;
+	size_t         nfields;
+	size_t        *start;
+	unsigned char *escaped;
+	size_t         cap;
+} tsv_record;
+
+#define TSV_RECORD_INIT {{0, 0}, 0, 0, 0, 0}
+
+TSV_API void
+tsv_record_free (tsv_record *r);
+
+/*
+	Parses the record at the start of buf[0..len) into r and returns the number
+	of bytes it took, including its newline. A last record without a newline runs
+	to len. A record always has at least one (maybe empty) field.
+*/
+TSV_API size_t
+tsv_parse (tsv_record *r, const char *buf, size_t len);
+
+/*
+	Field i as it appears in the input.
+*/
+TSV_API strview
+tsv_field_raw (const tsv_record *r, size_t i);
+
+/*
+	Field i, unescaped. A field without a backslash is returned as is; otherwise it
+	is unescaped into scratch, which must have room for tsv_field_raw(r, i).len
+	bytes. scratch may be the field itself if the buffer is writable.
+*/
+TSV_API strview
+tsv_field (const tsv_record *r, size_t i, char *scratch);
+
+/*
+	Writes escaped rows to fd, which tsv_writer_close leaves open. bufsize is the
+	buffer size in bytes (0 for TSV_WRITER_BUFSIZE); fields longer than the buffer
+	are fine, they just take several writes. Dies if out of memory.
+
+	Add a row's fields with tsv_put (or tsv_put_row for a whole row) and finish it
+	with tsv_end_row. These return 0, or -1 with errno set if a write failed;
+	after a failure the writer's buffer is discarded.
+*/
+typedef struct tsv_writer tsv_writer;
+
+TSV_API tsv_writer *
+tsv_writer_open (int fd, size_t bufsize);
+
+TSV_API int
+tsv_put (tsv_writer *w, const char *field, size_t len);
+
+TSV_API int
+tsv_end_row (tsv_writer *w);
+
+TSV_API int
+tsv_put_row (tsv_writer *w, size_t nfields, const strview *fields);
+
+/*
+	Writes out whatever is buffered.
+*/
+TSV_API int
+tsv_writer_flush (tsv_writer *w);
+
+/*
+	Flushes and frees w. Returns as tsv_writer_flush.
+*/
+TSV_API int
+tsv_writer_close (tsv_writer *w);
+
+#ifdef TSV_PARALLEL
+#include "pool.h"
+
+/*
+	Parses every record in buf[0..len) on pool p. The buffer is cut at newlines
+	(lr_split) into a few pieces per worker; fn(arg, piece, rec) is called for
+	each record, in order within a piece. Pieces are numbered in input order, so
+	results can be put back in order by piece.
+*/
+TSV_API void
+tsv_parse_parallel (pool *p, const char *buf, size_t len,
+	void (*fn)(void *arg, size_t piece, const tsv_record *rec), void *arg);
+#endif
+
+#endif
+
+#if defined(TSV_SELFTEST) && !defined(TSV_IMPLEMENTATION)
+#define TSV_IMPLEMENTATION
+#endif
+
+#ifdef TSV_IMPLEMENTATION
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "die.h"
+
+#ifndef TSVESCAPE_IMPLEMENTATION
+#define TSVESCAPE_IMPLEMENTATION
+#endif
+#include "tsvescape.h"
+
+#ifdef TSV_PARALLEL
+#include "linereader.h"
+#endif
+
+TSV_API void
+tsv_record_free (tsv_record *r)
+{
+	free(r->start);
+	free(r->escaped);
+	*r = (tsv_record)TSV_RECORD_INIT;
+}
+
+/*
+	Ends the current field just before the separator at pos and starts the next.
+*/
+static void
+tsv_next_field (tsv_record *r, size_t pos)
+{
+	if (r->nfields + 2 > r->cap) {
+		r->cap = r->cap ? r->cap * 2 : 16;
+		r->start   = realloc(r->start, r->cap * sizeof *r->start);
+		r->escaped = realloc(r->escaped, r->cap);
+		if (!r->start || !r->escaped) die("tsv: out of memory");
+	}
+	r->nfields++;
+	r->start[r->nfields] = pos + 1;
+	r->escaped[r->nfields] = 0;
+}
+
+static size_t
+tsv_end (tsv_record *r, const char *buf, size_t pos, size_t used)
+{
+	tsv_next_field(r, pos);
+	r->line = (strview){buf, pos};
+	return used;
+}
+
+TSV_API size_t
+tsv_parse (tsv_record *r, const char *buf, size_t len)
+{
+	if (!r->cap) tsv_next_field(r, 0);
+	r->nfields = 0;
+	r->start[0] = 0;
+	r->escaped[0] = 0;
+
+	size_t i = 0;
+#ifdef TSV_VEC
+	for (; i + TSV_VEC <= len; i += TSV_VEC) {
+		const tsv_vec v = tsv_load(buf + i);
+		const unsigned nl = tsv_eq(v, '\n');
+		const unsigned end = nl ? nl & -nl : 0;
+		/* only the separators and backslashes before the first newline count */
+		unsigned m = (tsv_eq(v, '\t') | tsv_eq(v, '\\')) & (end - 1);
+		while (m) {
+			const size_t at = i + (size_t)__builtin_ctz(m);
+			if (buf[at] == '\t') tsv_next_field(r, at);
+			else r->escaped[r->nfields] = 1;
+			m &= m - 1;
+		}
+		if (nl) {
+			const size_t at = i + (size_t)__builtin_ctz(nl);
+			return tsv_end(r, buf, at, at + 1);
+		}
+	}
+#endif
+	for (; i < len; i++) {
+		switch (buf[i]) {
+		case '\t': tsv_next_field(r, i); break;
+		case '\\': r->escaped[r->nfields] = 1; break;
+		case '\n': return tsv_end(r, buf, i, i + 1);
+		}
+	}
+	return tsv_end(r, buf, len, len);
+}
+
+TSV_API strview
+tsv_field_raw (const tsv_record *r, size_t i)
+{
+	xassert(i < r->nfields);
+	return (strview){r->line.ptr + r->start[i], r->start[i+1] - r->start[i] - 1};
+}
+
+TSV_API strview
+tsv_field (const tsv_record *r, size_t i, char *scratch)
+{
+	const strview f = tsv_field_raw(r, i);
+	if (!r->escaped[i]) return f;
+	return (strview){scratch, tsv_unescape(f.ptr, f.len, scratch)};
+}
+
+struct tsv_writer {
+	int     fd;
+	char   *buf;
+	size_t  cap, len;
+	size_t  nfields;
+};
+
+TSV_API tsv_writer *
+tsv_writer_open (int fd, size_t bufsize)
+{
+	tsv_writer *w = calloc(1, sizeof *w);
+	if (!w) die("tsv: out of memory");
+	w->fd  = fd;
+	w->cap = bufsize ? bufsize : TSV_WRITER_BUFSIZE;
+	w->buf = malloc(w->cap);
+	if (!w->buf) die("tsv: out of memory");
+	return w;
+}
+
+TSV_API int
+tsv_writer_flush (tsv_writer *w)
+{
+	size_t done = 0;
+	while (done < w->len) {
+		ssize_t k = write(w->fd, w->buf + done, w->len - done);
+		if (k < 0 && errno == EINTR) continue;
+		if (k < 0) {
+			w->len = 0;
+			return -1;
+		}
+		done += (size_t)k;
+	}
+	w->len = 0;
+	return 0;
+}
+
+static int
+tsv_putc (tsv_writer *w, char c)
+{
+	if (w->len == w->cap && tsv_writer_flush(w)) return -1;
+	w->buf[w->len++] = c;
+	return 0;
+}
+
+TSV_API int
+tsv_put (tsv_writer *w, const char *field, size_t len)
+{
+	if (w->nfields++ && tsv_putc(w, '\t')) return -1;
+	tsv_escape_state st = TSV_ESCAPE_STATE_INIT;
+	for (;;) {
+		size_t used;
+		w->len += tsv_escape(&st, field, len, &used, w->buf + w->len, w->cap - w->len);
+		field += used;
+		len   -= used;
+		if (!len && !st.pending) return 0;
+		if (tsv_writer_flush(w)) return -1;
+	}
+}
+
+TSV_API int
+tsv_end_row (tsv_writer *w)
+{
+	w->nfields = 0;
+	return tsv_putc(w, '\n');
+}
+
+TSV_API int
+tsv_put_row (tsv_writer *w, size_t nfields, const strview *fields)
+{
+	for (size_t i = 0; i < nfields; i++)
+		if (tsv_put(w, fields[i].ptr, fields[i].len)) return -1;
+	return tsv_end_row(w);
+}
+
+TSV_API int
+tsv_writer_close (tsv_writer *w)
+{
+	const int rc = tsv_writer_flush(w);
+	free(w->buf);
+	free(w);
+	return rc;
+}
+
+#ifdef TSV_PARALLEL
+
+typedef struct {
+	const char   *buf;
+	const size_t *cuts;
+	void        (*fn)(void *arg, size_t piece, const tsv_record *rec);
+	void         *arg;
+} tsv_job;
+
+static void
+tsv_job_range (void *arg, size_t lo, size_t hi)
+{
+	const tsv_job *j = arg;
+	tsv_record rec = TSV_RECORD_INIT;
+	for (size_t c = lo; c < hi; c++) {
+		const char *p = j->buf + j->cuts[c];
+		size_t left = j->cuts[c+1] - j->cuts[c];
+		while (left) {
+			const size_t used = tsv_parse(&rec, p, left);
+			j->fn(j->arg, c, &rec);
+			p += used;
+			left -= used;
+		}
+	}
+	tsv_record_free(&rec);
+}
+
+TSV_API void
+tsv_parse_parallel (pool *p, const char *buf, size_t len,
+	void (*fn)(void *arg, size_t piece, const tsv_record *rec), void *arg)
+{
+	size_t n = (size_t)pool_size(p) * 8;
+	if (n > len / 65536 + 1) n = len / 65536 + 1;
+	size_t *cuts = malloc((n + 1) * sizeof *cuts);
+	if (!cuts) die("tsv: out of memory");
+	lr_split(buf, len, n, cuts);
+	tsv_job j = {buf, cuts, fn, arg};
+	pool_parallel_for(p, 0, n, 1, tsv_job_range, &j);
+	free(cuts);
+}
+
+#endif
+
+#endif
+
+#ifdef TSV_SELFTEST
+
+#ifdef TSV_PARALLEL
+#ifndef QUEUE_IMPLEMENTATION
+#define QUEUE_IMPLEMENTATION
+#include "queue.h"
+#endif
+#ifndef POOL_IMPLEMENTATION
+#define POOL_IMPLEMENTATION
+#include "pool.h"
+#endif
+#ifndef LINEREADER_IMPLEMENTATION
+#define LINEREADER_IMPLEMENTATION
+#include "linereader.h"
+#endif
+#endif
+
+#include <stdio.h>
+
+/*
+	Random records of random fields, escaped with tsv_escape. Each field is kept
+	unescaped in tt_fields so parsing can be checked against it.
+*/
+#define TT_RECORDS 20000
+#define TT_MAXFIELDS 12
+
+static char   *tt_text;
+static size_t  tt_len;
+static char   *tt_fields[TT_RECORDS][TT_MAXFIELDS];
+static size_t  tt_flen[TT_RECORDS][TT_MAXFIELDS];
+static size_t  tt_nfields[TT_RECORDS];
+
+static void
+tt_make (void)
+{
+	size_t cap = 1 << 20;
+	tt_text = malloc(cap);
+	srand(5);
+	for (size_t r = 0; r < TT_RECORDS; r++) {
+		tt_nfields[r] = 1 + rand() % TT_MAXFIELDS;
+		for (size_t f = 0; f < tt_nfields[r]; f++) {
+			const size_t n = rand() % 4 ? rand() % 20 : rand() % 200;
+			char *s = tt_fields[r][f] = malloc(n + 1);
+			for (size_t i = 0; i < n; i++) s[i] = rand() % 8 ? 'a' + rand() % 26 : "\\\t\n\r"[rand() % 4];
+			tt_flen[r][f] = n;
+
+			if (tt_len + 2 * n + 2 > cap) tt_text = realloc(tt_text, cap *= 2);
+			tsv_escape_state st = TSV_ESCAPE_STATE_INIT;
+			size_t used;
+			tt_len += tsv_escape(&st, s, n, &used, tt_text + tt_len, cap - tt_len);
+			tt_text[tt_len++] = f + 1 < tt_nfields[r] ? '\t' : '\n';
+		}
+	}
+	tt_len--; /* the last record has no newline */
+}
+
+static void
+tt_check (size_t r, const tsv_record *rec)
+{
+	static _Thread_local char scratch[256];
+	xassert(rec->nfields == tt_nfields[r]);
+	for (size_t f = 0; f < rec->nfields; f++) {
+		const strview v = tsv_field(rec, f, scratch);
+		xassert(v.len == tt_flen[r][f] && !memcmp(v.ptr, tt_fields[r][f], v.len));
+		xassert(rec->escaped[f] == (memchr(tsv_field_raw(rec, f).ptr, '\\', tsv_field_raw(rec, f).len) != 0));
+	}
+}
+
+/*
+	Writes the test records through a tsv_writer with a buffer of bufsize and
+	checks the file matches the text built with tsv_escape.
+*/
+static void
+tt_write (size_t bufsize)
+{
+	FILE *f = tmpfile();
+	tsv_writer *w = tsv_writer_open(fileno(f), bufsize);
+	strview row[TT_MAXFIELDS];
+	for (size_t r = 0; r < TT_RECORDS; r++) {
+		if (r % 2) {
+			for (size_t i = 0; i < tt_nfields[r]; i++) xassert(0 == tsv_put(w, tt_fields[r][i], tt_flen[r][i]));
+			xassert(0 == tsv_end_row(w));
+			continue;
+		}
+		for (size_t i = 0; i < tt_nfields[r]; i++) row[i] = (strview){tt_fields[r][i], tt_flen[r][i]};
+		xassert(0 == tsv_put_row(w, tt_nfields[r], row));
+	}
+	xassert(0 == tsv_writer_close(w));
+
+	xassert(0 == fseek(f, 0, SEEK_END) && (size_t)ftell(f) == tt_len + 1);
+	rewind(f);
+	char *got = malloc(tt_len + 1);
+	xassert(tt_len + 1 == fread(got, 1, tt_len + 1, f));
+	xassert(!memcmp(got, tt_text, tt_len) && got[tt_len] == '\n');
+	free(got);
+	fclose(f);
+}
+
+#ifdef TSV_PARALLEL
+/*
+	Each piece records the first record it saw and how many; the pieces must
+	tile the records in order.
+*/
+static size_t tt_first[4096], tt_count[4096];
+
+static void
+tt_piece (void *arg, size_t piece, const tsv_record *rec)
+{
+	(void)arg;
+	xassert(piece < 4096);
+	if (!tt_count[piece]) {
+		/* find which record this is by its position in the text */
+		size_t r = 0;
+		for (const char *p = tt_text; p < rec->line.ptr; p++) r += *p == '\n';
+		tt_first[piece] = r;
+	}
+	tt_check(tt_first[piece] + tt_count[piece]++, rec);
+}
+#endif
+
+int main (void) {
+	tt_make();
+
+	tsv_record rec = TSV_RECORD_INIT;
+	size_t pos = 0, r = 0;
+	while (pos < tt_len) {
+		pos += tsv_parse(&rec, tt_text + pos, tt_len - pos);
+		tt_check(r++, &rec);
+	}
+	xassert(r == TT_RECORDS);
+
+	/* an empty line is one empty field; tabs alone are empty fields */
+	xassert(1 == tsv_parse(&rec, "\n", 1) && rec.nfields == 1 && tsv_field_raw(&rec, 0).len == 0);
+	xassert(2 == tsv_parse(&rec, "\t\t", 2) && rec.nfields == 3);
+	tsv_record_free(&rec);
+
+	tt_write(0);
+	tt_write(1);
+	tt_write(7);
+	tt_write(100);
+
+#ifdef TSV_PARALLEL
+	pool *p = pool_create(4);
+	tsv_parse_parallel(p, tt_text, tt_len, tt_piece, 0);
+	size_t next = 0;
+	for (size_t i = 0; i < 4096; i++) {
+		if (!tt_count[i]) continue;
+		xassert(tt_first[i] == next);
+		next += tt_count[i];
+	}
+	xassert(next == TT_RECORDS);
+	pool_destroy(p);
+#endif
+
+	for (size_t i = 0; i < TT_RECORDS; i++)
+		for (size_t f = 0; f < tt_nfields[i]; f++) free(tt_fields[i][f]);
+	free(tt_text);
+	printf("tsv selftest passed\n");
+	return 0;
+}
+
+#endif
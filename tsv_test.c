@@ -0,0 +1,3 @@
+#define TSV_SELFTEST
+#define TSV_PARALLEL
+#include "tsv.h"
@@ -1,7 +1,118 @@
+#ifndef TSVESCAPE_H
+#define TSVESCAPE_H
+
+/*
+	Escaping for TSV fields: a backslash, tab, newline or CR inside a field is
+	written as \\, \t, \n or \r.
+
+	To use: define TSVESCAPE_IMPLEMENTATION in one .c file before you include this
+	header (tsv.h's implementation file does so already).
+*/
+
+#ifndef TSVESCAPE_API
+#define TSVESCAPE_API
+#endif
+
+#include <stddef.h>
+
+/*
+	Escapes str in place. capacity must be at least twice strlen(str) + 1.
+*/
+TSVESCAPE_API void
+tsv_escape_inplace (char *str, size_t capacity);
+
+TSVESCAPE_API void
+tsv_unescape_inplace (char *str);
+
+/*
+	Streaming escape, out of place. Call tsv_escape with as much input and output
+	space as you have: it returns the number of bytes written to out and stores how
+	much of in it used in *consumed, stopping when either runs out. If an escape
+	pair is cut off by the end of out, its second byte is held in the state and
+	written first by the next call, so output buffers of any size work. After the
+	last input, call again with inlen 0 until it returns 0 to flush that byte.
+
+	Runs without any of \\ \t \n \r are copied a vector at a time, so clean fields
+	go at close to memcpy speed.
+*/
+typedef struct {
+	char pending;
+} tsv_escape_state;
+
+#define TSV_ESCAPE_STATE_INIT {0}
+
+TSVESCAPE_API size_t
+tsv_escape (tsv_escape_state *st, const char *in, size_t inlen, size_t *consumed, char *out, size_t outcap);
+
+/*
+	Unescapes in[0..len) into out, which may be in itself, and returns the length
+	written (never more than len). Escapes are decoded as tsv_unescape_inplace
+	does: an unknown escape, or a backslash at the end, is kept as is. Runs
+	without a backslash are copied a vector at a time.
+*/
+TSVESCAPE_API size_t
+tsv_unescape (const char *in, size_t len, char *out);
+
+#endif
+
+#if defined(TSVESCAPE_SELFTEST) && !defined(TSVESCAPE_IMPLEMENTATION)
+#define TSVESCAPE_IMPLEMENTATION
+#endif
+
+/* tsv.h defines it too, so a file may include the implementation twice */
+#if defined(TSVESCAPE_IMPLEMENTATION) && !defined(TSVESCAPE_IMPLEMENTED)
+#define TSVESCAPE_IMPLEMENTED
+
 #include <assert.h>
 #include <string.h>
 
-void 
+/*
+	tsv_eq(v, c) has bit i set if byte i of v is c. tsv_special_mask(v) does the
+	same for any of \\, \t, \n or \r; the escapers copy the bytes between those
+	a vector at a time.
+*/
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__AVX2__)
+#include <immintrin.h>
+#define TSV_VEC 32
+typedef __m256i tsv_vec;
+
+static inline tsv_vec tsv_load (const char *p) { return _mm256_loadu_si256((const __m256i *)p); }
+static inline void tsv_store (char *p, tsv_vec v) { _mm256_storeu_si256((__m256i *)p, v); }
+static inline unsigned tsv_eq (tsv_vec v, char c) { return (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))); }
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
+#include <emmintrin.h>
+#define TSV_VEC 16
+typedef __m128i tsv_vec;
+
+static inline tsv_vec tsv_load (const char *p) { return _mm_loadu_si128((const __m128i *)p); }
+static inline void tsv_store (char *p, tsv_vec v) { _mm_storeu_si128((__m128i *)p, v); }
+static inline unsigned tsv_eq (tsv_vec v, char c) { return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))); }
+#endif
+
+#ifdef TSV_VEC
+static inline unsigned
+tsv_special_mask (tsv_vec v)
+{
+	return tsv_eq(v, '\\') | tsv_eq(v, '\t') | tsv_eq(v, '\n') | tsv_eq(v, '\r');
+}
+#endif
+
+/*
+	The character after the backslash in the escape for c, or 0 if c is written as is.
+*/
+static inline char
+tsv_escape_char (char c)
+{
+	switch (c) {
+	case '\\': return '\\';
+	case '\r':  return 'r';
+	case '\n':  return 'n';
+	case '\t':  return 't';
+	default:    return 0;
+	}
+}
+
+TSVESCAPE_API void 
 tsv_escape_inplace(char * str, size_t capacity)
 {
 	/*
@@ -39,7 +150,7 @@ tsv_escape_inplace(char * str, size_t capacity)
 	}
 }
 
-void
+TSVESCAPE_API void
 tsv_unescape_inplace(char * str) 
 {
 	char * iptr = str;
@@ -71,3 +182,152 @@ tsv_unescape_inplace(char * str)
 	}
 	*optr = 0;
 }
+
+TSVESCAPE_API size_t
+tsv_escape(tsv_escape_state * st, const char * in, size_t inlen, size_t * consumed, char * out, size_t outcap)
+{
+	size_t i = 0, o = 0;
+	if (st->pending && outcap) {
+		out[o++] = st->pending;
+		st->pending = 0;
+	}
+	if (st->pending) {
+		*consumed = 0;
+		return 0;
+	}
+
+	while (i < inlen && o < outcap) {
+#ifdef TSV_VEC
+		/*
+			Store the whole vector even when it holds a special byte: only the bytes
+			before it count, and the rest is overwritten next.
+		*/
+		while (i + TSV_VEC <= inlen && o + TSV_VEC <= outcap) {
+			const tsv_vec v = tsv_load(in + i);
+			const unsigned m = tsv_special_mask(v);
+			tsv_store(out + o, v);
+			if (!m) {
+				i += TSV_VEC;
+				o += TSV_VEC;
+				continue;
+			}
+			const unsigned k = (unsigned)__builtin_ctz(m);
+			i += k;
+			o += k;
+			break;
+		}
+		if (i == inlen || o == outcap) break;
+#endif
+		const char c = in[i++];
+		const char e = tsv_escape_char(c);
+		if (!e) {
+			out[o++] = c;
+			continue;
+		}
+		out[o++] = '\\';
+		if (o == outcap) {
+			st->pending = e;
+			break;
+		}
+		out[o++] = e;
+	}
+	*consumed = i;
+	return o;
+}
+
+TSVESCAPE_API size_t
+tsv_unescape(const char * in, size_t len, char * out)
+{
+	size_t i = 0, o = 0;
+	while (i < len) {
+#ifdef TSV_VEC
+		for (; i + TSV_VEC <= len; i += TSV_VEC, o += TSV_VEC) {
+			const tsv_vec v = tsv_load(in + i);
+			const unsigned m = tsv_eq(v, '\\');
+			if (m) {
+				/* a partial store could clobber unread input when out == in */
+				const unsigned k = (unsigned)__builtin_ctz(m);
+				memmove(out + o, in + i, k);
+				i += k;
+				o += k;
+				break;
+			}
+			tsv_store(out + o, v);
+		}
+		if (i == len) break;
+#endif
+		const char c = in[i++];
+		if (c != '\\' || i == len) {
+			out[o++] = c;
+			continue;
+		}
+		switch (in[i]) {
+		case '\\': out[o++] = '\\'; i++; break;
+		case 'r':  out[o++] = '\r'; i++; break;
+		case 'n':  out[o++] = '\n'; i++; break;
+		case 't':  out[o++] = '\t'; i++; break;
+		default:   out[o++] = c; break;
+		}
+	}
+	return o;
+}
+
+#ifdef TSVESCAPE_SELFTEST
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+	Escape random text through output buffers of random (including tiny) sizes and
+	compare with escaping the whole thing at once with tsv_escape_inplace.
+*/
+int main(void)
+{
+	static char text[4096], whole[8194], streamed[8194];
+	srand(4);
+	for (int iter = 0; iter < 20000; iter++) {
+		const size_t len = rand() % sizeof(text);
+		const int clean = rand() % 2;
+		for (size_t i = 0; i < len; i++)
+			text[i] = clean && rand() % 64 ? 'a' + rand() % 26 : "ab\\\t\n\r"[rand() % 6];
+
+		const size_t sz = len;
+		memcpy(whole, text, len);
+		whole[len] = 0;
+		tsv_escape_inplace(whole, sizeof(whole));
+		const size_t wlen = strlen(whole);
+
+		tsv_escape_state st = TSV_ESCAPE_STATE_INIT;
+		size_t in = 0, o = 0;
+		for (;;) {
+			size_t cap = rand() % 3 ? 1 + rand() % 70 : 1;
+			if (cap > sizeof(streamed) - o) cap = sizeof(streamed) - o;
+			size_t used;
+			const size_t w = tsv_escape(&st, text + in, sz - in, &used, streamed + o, cap);
+			in += used;
+			o += w;
+			if (in == sz && !w) break;
+		}
+		assert(o == wlen && !memcmp(streamed, whole, o));
+	}
+	printf("tsv_escape matches tsv_escape_inplace\n");
+
+	/* tsv_unescape, in and out of place, against tsv_unescape_inplace */
+	for (int iter = 0; iter < 20000; iter++) {
+		const size_t len = rand() % (sizeof(text) - 1);
+		for (size_t i = 0; i < len; i++)
+			text[i] = rand() % 3 ? 'a' + rand() % 26 : "\\\\rntx\t"[rand() % 7];
+		memcpy(whole, text, len);
+		whole[len] = 0;
+		tsv_unescape_inplace(whole);
+		const size_t wlen = strlen(whole);
+		assert(wlen == tsv_unescape(text, len, streamed) && !memcmp(streamed, whole, wlen));
+		assert(wlen == tsv_unescape(text, len, text) && !memcmp(text, whole, wlen));
+	}
+	printf("tsv_unescape matches tsv_unescape_inplace\n");
+	return 0;
+}
+
+#endif
+
+#endif
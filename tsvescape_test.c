@@ -0,0 +1,3 @@
+#define TSVESCAPE_IMPLEMENTATION
+#define TSVESCAPE_SELFTEST
+#include "tsvescape.h"
@@ -0,0 +1,519 @@
+#ifndef URL_H
+#define URL_H
+
+/*
+	URL decoding ('+' becomes ' ' and %XX becomes the byte 0xXX) and encoding, on
+	bytes, plus a query string parser.
+
+	Decoding works on bytes, not characters, so a character escaped as several
+	%XX bytes (UTF-8 for instance) comes out as those bytes, whatever the locale.
+	A '%' that isn't followed by two hex digits is kept as it is.
+
+	Runs without a '%' or '+' are copied 16 or 32 bytes at a time with SSE2 or
+	AVX2, and hex digits are looked up in a table.
+
+	To use: define URL_IMPLEMENTATION in one .c file before you include this header.
+	Define URL_DICT everywhere you include it to get url_query_to_dict, which needs
+	dict.h implemented somewhere.
+*/
+
+#ifndef URL_API
+#define URL_API
+#endif
+
+#include <stddef.h>
+#include "stringfns.h"
+
+/*
+	Decodes in[0..len) into out, which may be in itself, and returns the decoded
+	length (never more than len).
+*/
+URL_API size_t
+url_decode (const char *in, size_t len, char *out);
+
+/*
+	Decodes the NUL-terminated str in place and returns its new length.
+*/
+URL_API size_t
+url_decode_inplace (char *str);
+
+/*
+	Streaming decoder, for input that arrives in pieces: an escape cut off at the
+	end of one piece is held in the state and finished with the next. Each call
+	writes at most len+2 bytes to out, which must not overlap in, and returns the
+	number written. url_decode_end writes out (at most 2) held bytes at the end of
+	the input.
+*/
+typedef struct {
+	char          held[2];
+	unsigned char nheld;
+} url_decode_state;
+
+#define URL_DECODE_STATE_INIT {{0, 0}, 0}
+
+URL_API size_t
+url_decode_stream (url_decode_state *st, const char *in, size_t len, char *out);
+
+URL_API size_t
+url_decode_end (url_decode_state *st, char *out);
+
+/*
+	Encodes in[0..len) into out, which needs room for 3*len bytes, and returns the
+	encoded length. Letters, digits and -._~ are kept, ' ' becomes '+', and every
+	other byte becomes %XX.
+*/
+URL_API size_t
+url_encode (const char *in, size_t len, char *out);
+
+/*
+	Iterates over the parameters of a query string without allocating or decoding:
+
+		url_query q = url_query_init(line, len);
+		strview key, val;
+		while (url_query_next(&q, &key, &val)) ...
+
+	url_query_init starts after the first '?', if there is one, and stops at '#'.
+	Parameters are separated by '&'; empty ones are skipped, and one without an
+	'=' has an empty value. key and val point into the input, still encoded:
+	decode them with url_decode if and when they are needed.
+*/
+typedef struct {
+	const char *p;
+	size_t      left;
+} url_query;
+
+URL_API url_query
+url_query_init (const char *s, size_t len);
+
+URL_API int
+url_query_next (url_query *q, strview *key, strview *val);
+
+#ifdef URL_DICT
+#include "dict.h"
+
+/*
+	Decodes every parameter of the query string s[0..len) into buf as NUL-terminated
+	keys and values, and sets them in the dict as char * values (pointing into buf,
+	so buf must outlive them), 64 at a time with dict_set_batch_charptr. buf needs
+	at most 2*len + 2 bytes. Returns the number of parameters, or -1 if buf was too small,
+	in which case nothing is set. Later duplicates win.
+*/
+URL_API int
+url_query_to_dict (int handle, const char *s, size_t len, char *buf, size_t bufsize);
+#endif
+
+#endif
+
+#if defined(URL_SELFTEST) && !defined(URL_IMPLEMENTATION)
+#define URL_IMPLEMENTATION
+#endif
+
+#ifdef URL_IMPLEMENTATION
+
+#include <string.h>
+
+/*
+	url_hexval[c] is 1 + the value of hex digit c, or 0 if c isn't one.
+*/
+static const unsigned char url_hexval[256] = {
+	['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,
+	['5'] = 6,  ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__AVX2__)
+#include <immintrin.h>
+#define URL_VEC 32
+
+typedef __m256i url_vec;
+static inline url_vec url_load (const char *p) { return _mm256_loadu_si256((const __m256i *)p); }
+static inline void url_store (char *p, url_vec v) { _mm256_storeu_si256((__m256i *)p, v); }
+
+static inline unsigned
+url_special_mask (url_vec v)
+{
+	const __m256i pc = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('%'));
+	const __m256i pl = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+'));
+	return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(pc, pl));
+}
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
+#include <emmintrin.h>
+#define URL_VEC 16
+
+typedef __m128i url_vec;
+static inline url_vec url_load (const char *p) { return _mm_loadu_si128((const __m128i *)p); }
+static inline void url_store (char *p, url_vec v) { _mm_storeu_si128((__m128i *)p, v); }
+
+static inline unsigned
+url_special_mask (url_vec v)
+{
+	const __m128i pc = _mm_cmpeq_epi8(v, _mm_set1_epi8('%'));
+	const __m128i pl = _mm_cmpeq_epi8(v, _mm_set1_epi8('+'));
+	return (unsigned)_mm_movemask_epi8(_mm_or_si128(pc, pl));
+}
+#endif
+
+/*
+	Decodes in[0..len) into out (o <= i throughout, so out may be in). If partial
+	is set and the input ends in what could still become an escape ("%" or "%X"),
+	stops before it; *stop is where decoding stopped.
+*/
+static size_t
+url_decode_run (const char *in, size_t len, char *out, int partial, size_t *stop)
+{
+	const unsigned char *u = (const unsigned char *)in;
+	size_t i = 0, o = 0;
+	while (i < len) {
+#ifdef URL_VEC
+		for (; i + URL_VEC <= len; i += URL_VEC, o += URL_VEC) {
+			const url_vec v = url_load(in + i);
+			const unsigned m = url_special_mask(v);
+			if (m) {
+				/* a full store could clobber unread input when out == in */
+				const unsigned k = (unsigned)__builtin_ctz(m);
+				memmove(out + o, in + i, k);
+				i += k;
+				o += k;
+				break;
+			}
+			url_store(out + o, v);
+		}
+		if (i == len) break;
+#endif
+		const char c = in[i];
+		if (c == '+') {
+			out[o++] = ' ';
+			i++;
+		} else if (c != '%') {
+			out[o++] = c;
+			i++;
+		} else if (i + 2 < len) {
+			const unsigned hi = url_hexval[u[i+1]], lo = url_hexval[u[i+2]];
+			if (hi && lo) {
+				out[o++] = (char)((hi - 1) << 4 | (lo - 1));
+				i += 3;
+			} else {
+				out[o++] = c;
+				i++;
+			}
+		} else if (partial && (i + 1 == len || url_hexval[u[i+1]])) {
+			break;
+		} else {
+			out[o++] = c;
+			i++;
+		}
+	}
+	*stop = i;
+	return o;
+}
+
+URL_API size_t
+url_decode (const char *in, size_t len, char *out)
+{
+	size_t stop;
+	return url_decode_run(in, len, out, 0, &stop);
+}
+
+URL_API size_t
+url_decode_inplace (char *str)
+{
+	const size_t n = url_decode(str, strlen(str), str);
+	str[n] = 0;
+	return n;
+}
+
+URL_API size_t
+url_decode_stream (url_decode_state *st, const char *in, size_t len, char *out)
+{
+	size_t i = 0, o = 0, stop;
+	if (st->nheld) {
+		/* the held bytes plus up to two more are enough to settle the escape */
+		char t[4];
+		const size_t h = st->nheld, take = len < 2 ? len : 2;
+		memcpy(t, st->held, h);
+		memcpy(t + h, in, take);
+		o = url_decode_run(t, h + take, out, 1, &stop);
+		st->nheld = 0;
+		if (stop < h) {
+			/* still unsettled, which means the input ran out */
+			st->nheld = (unsigned char)(h + take - stop);
+			memcpy(st->held, t + stop, st->nheld);
+			return o;
+		}
+		i = stop - h;
+	}
+	o += url_decode_run(in + i, len - i, out + o, 1, &stop);
+	st->nheld = (unsigned char)(len - i - stop);
+	memcpy(st->held, in + i + stop, st->nheld);
+	return o;
+}
+
+URL_API size_t
+url_decode_end (url_decode_state *st, char *out)
+{
+	const size_t n = st->nheld;
+	memcpy(out, st->held, n);
+	st->nheld = 0;
+	return n;
+}
+
+static inline int
+url_keep (unsigned char c)
+{
+	return (unsigned char)((c | 0x20) - 'a') < 26 || (unsigned char)(c - '0') < 10
+		|| c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/*
+	url_keep_mask(p) has bit i set if p[i] is kept as is by url_encode. Ranges are
+	checked as (x - lo) <= n with min_epu8, since there is no unsigned compare.
+*/
+#if URL_VEC == 32
+#define URL_VEC_ALL 0xffffffffu
+static inline unsigned
+url_keep_mask (__m256i v)
+{
+	const __m256i lc = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+	const __m256i dg = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+	__m256i k = _mm256_or_si256(
+		_mm256_cmpeq_epi8(_mm256_min_epu8(lc, _mm256_set1_epi8(25)), lc),
+		_mm256_cmpeq_epi8(_mm256_min_epu8(dg, _mm256_set1_epi8(9)), dg));
+	k = _mm256_or_si256(k, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('-')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.'))));
+	k = _mm256_or_si256(k, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('~'))));
+	return (unsigned)_mm256_movemask_epi8(k);
+}
+#elif URL_VEC == 16
+#define URL_VEC_ALL 0xffffu
+static inline unsigned
+url_keep_mask (__m128i v)
+{
+	const __m128i lc = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	const __m128i dg = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+	__m128i k = _mm_or_si128(
+		_mm_cmpeq_epi8(_mm_min_epu8(lc, _mm_set1_epi8(25)), lc),
+		_mm_cmpeq_epi8(_mm_min_epu8(dg, _mm_set1_epi8(9)), dg));
+	k = _mm_or_si128(k, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')), _mm_cmpeq_epi8(v, _mm_set1_epi8('.'))));
+	k = _mm_or_si128(k, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')), _mm_cmpeq_epi8(v, _mm_set1_epi8('~'))));
+	return (unsigned)_mm_movemask_epi8(k);
+}
+#endif
+
+URL_API size_t
+url_encode (const char *in, size_t len, char *out)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	size_t i = 0, o = 0;
+	while (i < len) {
+#ifdef URL_VEC
+		/* out has 3*len bytes, so a whole vector always fits at o <= 3*i */
+		for (; i + URL_VEC <= len; i += URL_VEC, o += URL_VEC) {
+			const url_vec v = url_load(in + i);
+			const unsigned m = ~url_keep_mask(v) & URL_VEC_ALL;
+			url_store(out + o, v);
+			if (m) {
+				const unsigned k = (unsigned)__builtin_ctz(m);
+				i += k;
+				o += k;
+				break;
+			}
+		}
+		if (i == len) break;
+#endif
+		const unsigned char c = (unsigned char)in[i++];
+		if (url_keep(c)) {
+			out[o++] = (char)c;
+		} else if (c == ' ') {
+			out[o++] = '+';
+		} else {
+			out[o++] = '%';
+			out[o++] = hex[c >> 4];
+			out[o++] = hex[c & 15];
+		}
+	}
+	return o;
+}
+
+URL_API url_query
+url_query_init (const char *s, size_t len)
+{
+	const char *q = memchr(s, '?', len);
+	if (q) {
+		len -= (size_t)(q + 1 - s);
+		s = q + 1;
+	}
+	const char *h = memchr(s, '#', len);
+	if (h) len = (size_t)(h - s);
+	return (url_query){s, len};
+}
+
+URL_API int
+url_query_next (url_query *q, strview *key, strview *val)
+{
+	while (q->left) {
+		const char *amp = memchr(q->p, '&', q->left);
+		const size_t n = amp ? (size_t)(amp - q->p) : q->left;
+		const char *p = q->p;
+		q->p    += amp ? n + 1 : n;
+		q->left -= amp ? n + 1 : n;
+		if (!n) continue;
+
+		const char *eq = memchr(p, '=', n);
+		*key = (strview){p, eq ? (size_t)(eq - p) : n};
+		*val = eq ? (strview){eq + 1, n - key->len - 1} : (strview){p + n, 0};
+		return 1;
+	}
+	return 0;
+}
+
+#ifdef URL_DICT
+URL_API int
+url_query_to_dict (int handle, const char *s, size_t len, char *buf, size_t bufsize)
+{
+	enum { BATCH = 64 };
+	const char *keys[BATCH];
+	char *vals[BATCH];
+	strview k, v;
+
+	/* check buf is big enough first, so that a short one leaves the dict as it was */
+	size_t need = 0;
+	url_query q = url_query_init(s, len);
+	while (url_query_next(&q, &k, &v)) need += k.len + v.len + 2;
+	if (need > bufsize) return -1;
+
+	size_t n = 0, used = 0;
+	int total = 0;
+	q = url_query_init(s, len);
+	while (url_query_next(&q, &k, &v)) {
+		keys[n] = buf + used;
+		used += url_decode(k.ptr, k.len, buf + used);
+		buf[used++] = 0;
+		vals[n++] = buf + used;
+		used += url_decode(v.ptr, v.len, buf + used);
+		buf[used++] = 0;
+		total++;
+		if (n == BATCH) {
+			dict_set_batch_charptr(handle, n, keys, vals);
+			n = 0;
+		}
+	}
+	if (n) dict_set_batch_charptr(handle, n, keys, vals);
+	return total;
+}
+#endif
+
+#endif
+
+#ifdef URL_SELFTEST
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "die.h"
+
+static int
+ut_hex (char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/*
+	Byte-at-a-time reference decoder.
+*/
+static size_t
+ut_ref (const char *in, size_t len, char *out)
+{
+	size_t o = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (in[i] == '+') out[o++] = ' ';
+		else if (in[i] == '%' && i + 2 < len && ut_hex(in[i+1]) >= 0 && ut_hex(in[i+2]) >= 0) {
+			out[o++] = (char)(ut_hex(in[i+1]) << 4 | ut_hex(in[i+2]));
+			i += 2;
+		}
+		else out[o++] = in[i];
+	}
+	return o;
+}
+
+int main (void) {
+	char s[] = "caf%C3%A9+%E2%82%AC%2b%zz%4%";
+	url_decode_inplace(s);
+	xassert(!strcmp(s, "caf\xc3\xa9 \xe2\x82\xac+%zz%4%"));
+
+	static char text[3000], want[3000], got[3000], copy[3000];
+	srand(6);
+	for (int iter = 0; iter < 20000; iter++) {
+		const size_t len = rand() % sizeof(text);
+		const int sparse = rand() % 2;
+		for (size_t i = 0; i < len; i++)
+			text[i] = sparse && rand() % 50 ? 'a' + rand() % 26 : "%%+0aF9g\n"[rand() % 9];
+		const size_t n = ut_ref(text, len, want);
+
+		xassert(n == url_decode(text, len, got) && !memcmp(got, want, n));
+		memcpy(copy, text, len);
+		xassert(n == url_decode(copy, len, copy) && !memcmp(copy, want, n));
+
+		/* streamed in pieces of random size, including empty ones */
+		url_decode_state st = URL_DECODE_STATE_INIT;
+		size_t i = 0, o = 0;
+		while (i < len) {
+			size_t k = rand() % 4 ? rand() % 5 : rand() % 300;
+			if (k > len - i) k = len - i;
+			o += url_decode_stream(&st, text + i, k, got + o);
+			i += k;
+		}
+		o += url_decode_end(&st, got + o);
+		xassert(o == n && !memcmp(got, want, n));
+	}
+	/* encoding: round trips, and matches a byte-at-a-time encoder */
+	static char enc[9000], ref[9000];
+	for (int iter = 0; iter < 20000; iter++) {
+		const size_t len = rand() % sizeof(text);
+		const int sparse = rand() % 2;
+		for (size_t i = 0; i < len; i++)
+			text[i] = sparse && rand() % 50 ? "aZ9-._~"[rand() % 7] : (char)rand();
+		size_t r = 0;
+		for (size_t i = 0; i < len; i++) {
+			const unsigned char c = (unsigned char)text[i];
+			if (isalnum(c) || (c && strchr("-._~", c))) ref[r++] = (char)c;
+			else if (c == ' ') ref[r++] = '+';
+			else r += (size_t)sprintf(ref + r, "%%%02X", c);
+		}
+		const size_t n = url_encode(text, len, enc);
+		xassert(n == r && !memcmp(enc, ref, n));
+		xassert(len == url_decode(enc, n, got) && !memcmp(got, text, len));
+	}
+
+	/* query strings */
+	const char *qs = "GET /search?q=caf%C3%A9+au+lait&&lang=fr&flag&a%3Db=x%3Dy=z#top";
+	const char *want_keys[] = {"q", "lang", "flag", "a%3Db"};
+	const char *want_vals[] = {"caf%C3%A9+au+lait", "fr", "", "x%3Dy=z"};
+	url_query q = url_query_init(qs, strlen(qs));
+	strview k, v;
+	size_t np = 0;
+	while (url_query_next(&q, &k, &v)) {
+		xassert(np < 4 && sv_eq(k, sv_cstr(want_keys[np])) && sv_eq(v, sv_cstr(want_vals[np])));
+		np++;
+	}
+	xassert(np == 4);
+
+#ifdef URL_DICT
+	char qbuf[256];
+	int d = mkdict();
+	xassert(-1 == url_query_to_dict(d, qs, strlen(qs), qbuf, 10));
+	xassert(4 == url_query_to_dict(d, qs, strlen(qs), qbuf, sizeof qbuf));
+	char *val;
+	xassert(dict_get(d, "q", &val) && !strcmp(val, "caf\xc3\xa9 au lait"));
+	xassert(dict_get(d, "a=b", &val) && !strcmp(val, "x=y=z"));
+	xassert(dict_get(d, "flag", &val) && !strcmp(val, ""));
+	rmdict(d);
+#endif
+
+	printf("url selftest passed\n");
+	return 0;
+}
+
+#endif
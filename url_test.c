@@ -0,0 +1,5 @@
+#define STRINGFNS_IMPLEMENTATION
+#define DICT_IMPLEMENTATION
+#define URL_DICT
+#define URL_SELFTEST
+#include "url.h"
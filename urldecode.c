@@ -1,46 +1,213 @@
 /*
-	Decode URL-escaped string (i.e. '+' becomes ' ' and '%NN' becomes whatever character is '\xNN'
+	Decode URL-escaped input (i.e. '+' becomes ' ' and '%NN' becomes the byte '\xNN').
+	Works on bytes, so multi-byte (e.g. UTF-8) escapes come out intact in any locale,
+	and has no line length limit.
+
+	usage: urldecode [-j threads]
+
+	With -j, input is read in large chunks cut at line boundaries, the chunks are
+	decoded on that many worker threads (0 for one per CPU), and written out in
+	input order. A reader, the workers and a writer hand chunks along through two
+	queue.h queues:
+
+		reader --work--> workers --order--> writer
+
+	The reader claims a slot in order, fills it and passes its index to the workers
+	through work. A worker decodes the chunk and completes the slot. Completed slots
+	only become visible to the writer once every earlier slot is complete, which
+	keeps the output in order, and a slot is only reused once it has been written.
+
+	urldecode_bench.c times this against the serial mode, on escaped text and on
+	longlines.c-style million-character lines.
+*/
+#define _GNU_SOURCE /* memrchr */
+#define URL_IMPLEMENTATION
+#include "url.h"
+#define QUEUE_IMPLEMENTATION
+#include "queue.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "die.h"
+
+#ifndef CHUNK
+#define CHUNK (1 << 20)
+#endif
+
+static void
+write_all (int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t k = write(fd, buf, len);
+		if (k < 0 && errno == EINTR) continue;
+		if (k < 0) die("urldecode: write failed");
+		buf += k;
+		len -= (size_t)k;
+	}
+}
+
+/*
+	Fills buf[have..cap) as far as the input allows. Returns the new length.
 */
-#include <stdio.h>
-#include <wchar.h>
-#include <locale.h>
-
-int 
-main(int argc, char ** argv)
-{
-	const size_t N = 4096;
-	wchar_t buf[N];
-
-	setlocale(LC_ALL, "");
-
-	while(fgetws(buf,N,stdin)) {
-		
-		wchar_t *p = buf;
-		while(*p != 0) {
-			if (L'+' == *p) fputwc(L' ', stdout);
-
-			else if (L'%' == *p) {
-				if(p[1]==0) {
-					ungetwc(*p,stdin);
-					break;
-				}
-				if(p[2]==0) {
-					ungetwc(*p,stdin);
-					ungetwc(p[1],stdin);
-					break;
-				}
-				wchar_t number[3] = {};
-				number[0] = p[1];
-				number[1] = p[2];
-				int x = wcstol(number, 0, 16);
-				putwc(btowc(x), stdout);
-				p+=2;
-			}
-
-			else fputwc(*p, stdout);
-
-			p++;
+static size_t
+read_full (int fd, char *buf, size_t have, size_t cap, int *eof)
+{
+	while (have < cap) {
+		ssize_t k = read(fd, buf + have, cap - have);
+		if (k < 0 && errno == EINTR) continue;
+		if (k < 0) die("urldecode: read failed");
+		if (k == 0) {
+			*eof = 1;
+			break;
 		}
+		have += (size_t)k;
+	}
+	return have;
+}
 
+static void
+decode_serial (void)
+{
+	static char in[CHUNK], out[CHUNK + 2];
+	url_decode_state st = URL_DECODE_STATE_INIT;
+
+	for (;;) {
+		ssize_t k = read(0, in, sizeof in);
+		if (k < 0 && errno == EINTR) continue;
+		if (k < 0) die("urldecode: read failed");
+		if (k == 0) break;
+		write_all(1, out, url_decode_stream(&st, in, (size_t)k, out));
 	}
+	write_all(1, out, url_decode_end(&st, out));
+}
+
+typedef struct {
+	char   *in, *out;
+	size_t  len, outlen;
+	int     last;
+} chunk;
+
+static chunk    *chunks;
+static queue     order, work;
+static unsigned *jobs;
+
+#define NO_JOB UINT_MAX
+
+static int
+worker (void *arg)
+{
+	(void)arg;
+	for (;;) {
+		const unsigned s = queue_claim_get(&work);
+		const unsigned c = jobs[s];
+		queue_complete_get(&work, s);
+		if (c == NO_JOB) return 0;
+		chunks[c].outlen = url_decode(chunks[c].in, chunks[c].len, chunks[c].out);
+		queue_complete_put(&order, c);
+	}
+}
+
+static int
+writer (void *arg)
+{
+	(void)arg;
+	for (;;) {
+		const unsigned c = queue_claim_get(&order);
+		const int last = chunks[c].last;
+		write_all(1, chunks[c].out, chunks[c].outlen);
+		queue_complete_get(&order, c);
+		if (last) return 0;
+	}
+}
+
+static void
+submit (unsigned c)
+{
+	const unsigned s = queue_begin_put(&work);
+	jobs[s] = c;
+	queue_commit_put(&work);
+}
+
+/*
+	Where to end a chunk of len bytes: just after its last newline, or failing that
+	before an escape the end of the chunk cuts short.
+*/
+static size_t
+cut_point (const char *buf, size_t len)
+{
+	const char *nl = memrchr(buf, '\n', len);
+	if (nl) return (size_t)(nl - buf) + 1;
+	if (len >= 1 && buf[len-1] == '%') return len - 1;
+	if (len >= 2 && buf[len-2] == '%') return len - 2;
+	return len;
+}
+
+static void
+decode_parallel (unsigned nthreads)
+{
+	const unsigned nchunks = 2 * nthreads + 2;
+	queue_init(&order, nchunks + 1);
+	queue_init(&work, nchunks + nthreads + 1);
+	chunks = calloc(nchunks + 1, sizeof *chunks);
+	jobs = calloc(nchunks + nthreads + 1, sizeof *jobs);
+	if (!chunks || !jobs) die("urldecode: out of memory");
+	for (unsigned i = 0; i <= nchunks; i++) {
+		chunks[i].in  = malloc(CHUNK);
+		chunks[i].out = malloc(CHUNK);
+		if (!chunks[i].in || !chunks[i].out) die("urldecode: out of memory");
+	}
+
+	thrd_t w, *t = malloc(nthreads * sizeof *t);
+	if (!t) die("urldecode: out of memory");
+	for (unsigned i = 0; i < nthreads; i++)
+		if (thrd_success != thrd_create(&t[i], worker, 0)) die("urldecode: thrd_create");
+	if (thrd_success != thrd_create(&w, writer, 0)) die("urldecode: thrd_create");
+
+	static char carry[CHUNK];
+	size_t ncarry = 0;
+	int eof = 0;
+	while (!eof) {
+		const unsigned c = queue_claim_put(&order);
+		chunk *k = &chunks[c];
+		memcpy(k->in, carry, ncarry);
+		const size_t len = read_full(0, k->in, ncarry, CHUNK, &eof);
+		k->len = eof ? len : cut_point(k->in, len);
+		ncarry = len - k->len;
+		memcpy(carry, k->in + k->len, ncarry);
+		k->last = eof;
+		submit(c);
+	}
+
+	for (unsigned i = 0; i < nthreads; i++) submit(NO_JOB);
+	for (unsigned i = 0; i < nthreads; i++) thrd_join(t[i], 0);
+	thrd_join(w, 0);
+
+	for (unsigned i = 0; i <= nchunks; i++) {
+		free(chunks[i].in);
+		free(chunks[i].out);
+	}
+	free(chunks);
+	free(jobs);
+	free(t);
+	queue_destroy(&order);
+	queue_destroy(&work);
+}
+
+int
+main (int argc, char **argv)
+{
+	if (argc == 1) {
+		decode_serial();
+		return 0;
+	}
+	if (argc != 3 || strcmp(argv[1], "-j")) die("usage: urldecode [-j threads]");
+
+	long n = strtol(argv[2], 0, 10);
+	if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n <= 0) n = 1;
+	decode_parallel((unsigned)n);
+	return 0;
 }
@@ -0,0 +1,186 @@
+/*
+	Throughput of urldecode, serial versus the -j pipeline.
+
+	Build: cc -O2 -pthread urldecode.c -o urldecode
+	       cc -O2 urldecode_bench.c -o urldecode_bench
+	Usage: urldecode_bench [megabytes [threads...]]
+
+	Writes two corpora of the given size (default 256 MB) to temporary files:
+
+	escaped:   lines of 20 to 2000 bytes, mostly plain text with a '+' or a %XX
+	           escape every few bytes.
+	longlines: what longlines.c writes, lines of a million letters, digits and
+	           spaces (here a fixed seed, and as many lines as fit the size). This
+	           is the case with no newline in a whole chunk.
+
+	Then runs ./urldecode on each, once without -j and once with -j for each
+	thread count (default 1, 2, 4 and one per CPU), best of three runs each, and
+	reports MB/s of input. Each mode's output is checked against the serial
+	output before it is timed.
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "die.h"
+
+static long long
+now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ll + t.tv_nsec;
+}
+
+static FILE *
+corpus_file(char **path)
+{
+	*path = strdup("/tmp/urldecode-bench-XXXXXX");
+	int fd = mkstemp(*path);
+	if (fd < 0) die("urldecode_bench: mkstemp");
+	FILE *f = fdopen(fd, "w");
+	if (!f) die("urldecode_bench: fdopen");
+	return f;
+}
+
+static char *
+make_escaped(size_t size)
+{
+	static const char plain[] = "abcdefghijklmnopqrstuvwxyz0123456789-._~/=&";
+	static const char hex[] = "0123456789ABCDEF";
+
+	char *path;
+	FILE *f = corpus_file(&path);
+	srand(1);
+	size_t n = 0;
+	while (n < size) {
+		const size_t len = 20 + (size_t)rand() % 1980;
+		for (size_t i = 0; i < len; i++, n++) {
+			const int r = rand() % 16;
+			if (r == 0) {
+				fputc('+', f);
+			} else if (r == 1) {
+				fputc('%', f);
+				fputc(hex[rand() % 16], f);
+				fputc(hex[rand() % 16], f);
+				n += 2;
+			} else {
+				fputc(plain[rand() % (sizeof(plain) - 1)], f);
+			}
+		}
+		fputc('\n', f);
+		n++;
+	}
+	if (fclose(f)) die("urldecode_bench: writing the corpus failed");
+	return path;
+}
+
+static char *
+make_longlines(size_t size)
+{
+	static const char tab[] = "abcdefghijklmnopqrstuvwxyz0123456789        ";
+
+	char *path;
+	FILE *f = corpus_file(&path);
+	srand(2);
+	for (size_t n = 0; n < size; ) {
+		for (int j = 1; j < 1000000 && n < size; j++, n++)
+			fputc(tab[rand() % (sizeof(tab) - 1)], f);
+		fputc('\n', f);
+		n++;
+	}
+	if (fclose(f)) die("urldecode_bench: writing the corpus failed");
+	return path;
+}
+
+/*
+	Runs ./urldecode [-j threads] < in > out and returns how long it took.
+	threads < 0 runs it without -j.
+*/
+static long long
+run(const char *in, const char *out, int threads)
+{
+	char j[16];
+	snprintf(j, sizeof j, "%d", threads);
+	char *argv[] = {"./urldecode", threads < 0 ? 0 : "-j", j, 0};
+
+	const long long t = now_ns();
+	pid_t pid = fork();
+	if (pid < 0) die("urldecode_bench: fork");
+	if (pid == 0) {
+		int i = open(in, O_RDONLY);
+		int o = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (i < 0 || o < 0 || dup2(i, 0) < 0 || dup2(o, 1) < 0) _exit(127);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+		die("urldecode_bench: ./urldecode failed (is it built?)");
+	return now_ns() - t;
+}
+
+static int
+same_file(const char *a, const char *b)
+{
+	FILE *f = fopen(a, "rb"), *g = fopen(b, "rb");
+	if (!f || !g) die("urldecode_bench: fopen");
+	int x, y;
+	do {
+		x = fgetc(f);
+		y = fgetc(g);
+	} while (x == y && x != EOF);
+	fclose(f);
+	fclose(g);
+	return x == y;
+}
+
+static void
+bench(const char *corpus, size_t size, const char *ref, int threads)
+{
+	const char *out = threads < 0 ? ref : "/tmp/urldecode-bench-out";
+	run(corpus, out, threads);
+	if (threads >= 0 && !same_file(out, ref)) die("urldecode_bench: -j %d output differs from serial", threads);
+
+	long long best = 0;
+	for (int i = 0; i < 3; i++) {
+		long long t = run(corpus, "/dev/null", threads);
+		if (!best || t < best) best = t;
+	}
+	if (threads < 0) printf("  serial    ");
+	else printf("  -j %-6d ", threads);
+	printf("%10.1f MB/s\n", size / 1e6 / (best / 1e9));
+}
+
+static void
+bench_corpus(const char *name, char *corpus, size_t size, int argc, char **argv)
+{
+	const char *ref = "/tmp/urldecode-bench-ref";
+	printf("%s\n", name);
+	bench(corpus, size, ref, -1);
+	if (argc > 2) {
+		for (int i = 2; i < argc; i++) bench(corpus, size, ref, atoi(argv[i]));
+	} else {
+		const int threads[] = {1, 2, 4, 0};
+		for (int i = 0; i < 4; i++) bench(corpus, size, ref, threads[i]);
+	}
+	unlink(corpus);
+	unlink(ref);
+	free(corpus);
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t size = (argc > 1 ? strtoul(argv[1], 0, 10) : 256) << 20;
+
+	printf("%zu MB corpora, %ld CPUs\n", size >> 20, sysconf(_SC_NPROCESSORS_ONLN));
+	bench_corpus("escaped", make_escaped(size), size, argc, argv);
+	bench_corpus("longlines", make_longlines(size), size, argc, argv);
+	unlink("/tmp/urldecode-bench-out");
+	return 0;
+}